@@ -0,0 +1,357 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <argp.h>
+#include <inttypes.h>
+#include <err.h>
+#include <errno.h>
+#include <time.h>
+
+#include "version.h"
+#include "libutils.h"
+#include "libdevs.h"
+#include "libflow.h"
+
+/* Argp's global variables. */
+const char *argp_program_version = "F3 Bench " F3_STR_VERSION;
+
+/* Arguments. */
+static char adoc[] = "";
+
+static char doc[] = "F3 Bench -- measure the throughput of the hot paths "
+	"of F3 to catch performance regressions";
+
+static struct argp_option options[] = {
+	{"dir",			'd',	"DIR",		0,
+		"Directory for the emulated drives; it should be on a tmpfs",
+		0},
+	{"size",		's',	"SIZE_BYTE",	0,
+		"Size of the buffers and emulated drives",	0},
+	{"min-time",		't',	"MS",		0,
+		"Minimum time spent measuring each case",	0},
+	{"json",		'j',	"FILE",		0,
+		"Also write the results in JSON to FILE; - is stdout",	0},
+	{ 0 }
+};
+
+struct args {
+	const char	*dir;
+	uint64_t	size;
+	uint64_t	min_time_ns;
+	const char	*json_filename;
+};
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+	struct args *args = state->input;
+	long long ll;
+	char *end;
+
+	switch (key) {
+	case 'd':
+		args->dir = arg;
+		break;
+
+	case 's':
+		ll = arg_to_ll_bytes(state, arg);
+		if (ll < (long long)MEGABYTE_SIZE || !is_power_of_2(ll))
+			argp_error(state,
+				"Size must be a power of 2 of at least 1MB");
+		args->size = ll;
+		break;
+
+	case 't':
+		/* A time has no units of bytes. */
+		ll = strtoll(arg, &end, 10);
+		if (end == arg || *end != '\0')
+			argp_error(state, "MS must be an integer");
+		if (ll <= 0)
+			argp_error(state,
+				"Minimum time must be greater than zero");
+		args->min_time_ns = ll * 1000000ULL;
+		break;
+
+	case 'j':
+		args->json_filename = arg;
+		break;
+
+	case ARGP_KEY_ARG:
+		argp_error(state, "Wrong number of arguments; none is allowed");
+		break;
+
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp argp = {options, parse_opt, adoc, doc, NULL, NULL, NULL};
+
+struct result {
+	const char	*name;
+	const char	*input;
+	unsigned int	block_order;
+	double		value;
+	const char	*unit;
+};
+
+#define MAX_RESULTS	(64)
+
+struct bench {
+	const struct args	*args;
+	char			*buf;
+	struct result		results[MAX_RESULTS];
+	int			n_results;
+};
+
+typedef void (*bench_cb)(struct bench *b, unsigned int block_order);
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec t;
+	assert(!clock_gettime(CLOCK_MONOTONIC, &t));
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* Call @cb until at least the minimum time has passed, and
+ * return the number of calls per second.
+ */
+static double run_bench(struct bench *b, bench_cb cb, unsigned int block_order)
+{
+	uint64_t start, elapsed, calls = 0;
+
+	/* Warm up caches and page tables. */
+	cb(b, block_order);
+
+	start = now_ns();
+	do {
+		cb(b, block_order);
+		calls++;
+		elapsed = now_ns() - start;
+	} while (elapsed < b->args->min_time_ns);
+	return calls * 1000000000.0 / elapsed;
+}
+
+static void add_result(struct bench *b, const char *name, const char *input,
+	unsigned int block_order, double value, const char *unit)
+{
+	struct result *r;
+
+	assert(b->n_results < MAX_RESULTS);
+	r = &b->results[b->n_results++];
+	r->name = name;
+	r->input = input;
+	r->block_order = block_order;
+	r->value = value;
+	r->unit = unit;
+	printf("%-28s %-12s %5u %12.3f %s\n",
+		name, input, block_order, value, unit);
+	fflush(stdout);
+}
+
+/* Add the result of a case that processes the whole buffer per call. */
+static void bench_buffer(struct bench *b, const char *name, const char *input,
+	bench_cb cb, unsigned int block_order)
+{
+	add_result(b, name, input, block_order,
+		run_bench(b, cb, block_order) * b->args->size / GIGABYTE_SIZE,
+		"GB/s");
+}
+
+static void fill_buf(struct bench *b, unsigned int block_order)
+{
+	const uint64_t block_size = 1ULL << block_order;
+	uint64_t offset;
+
+	for (offset = 0; offset < b->args->size; offset += block_size)
+		fill_buffer_with_block(b->buf + offset, block_order, offset, 0);
+}
+
+static void fill_buf_batch(struct bench *b, unsigned int block_order)
+{
+	fill_buffer_with_blocks(b->buf, b->args->size >> block_order,
+		block_order, 0, 0, is_larger_than_cache(b->args->size));
+}
+
+static void validate_buf(struct bench *b, unsigned int block_order)
+{
+	const uint64_t block_size = 1ULL << block_order;
+	uint64_t offset, found_offset;
+
+	for (offset = 0; offset < b->args->size; offset += block_size)
+		validate_buffer_with_block(b->buf + offset, block_order,
+			offset, &found_offset, 0);
+}
+
+/* This is what check_buffer() of f3read does. */
+static void check_buf(struct bench *b, unsigned int block_order)
+{
+	struct block_stats stats = {0, 0, 0, 0};
+
+	validate_blocks_update_stats(b->buf, b->args->size >> block_order,
+		block_order, 0, 0, &stats, is_larger_than_cache(b->args->size));
+}
+
+/* Grow a fresh dynamic buffer from a block to the whole size,
+ * as f3write and f3read do when their chunks grow.
+ */
+static void churn_dbuf(struct bench *b, unsigned int block_order)
+{
+	struct dynamic_buffer dbuf;
+	size_t size;
+
+	dbuf_init(&dbuf);
+	for (size = 1ULL << block_order; size <= b->args->size; size <<= 1) {
+		size_t len = size;
+		char *buf = dbuf_get_buf(&dbuf, block_order, &len);
+		/* Touch the buffer, so its pages are really allocated. */
+		buf[0] = buf[len - 1] = 0;
+	}
+	dbuf_free(&dbuf);
+}
+
+static void bench_pattern(struct bench *b, unsigned int block_order)
+{
+	bench_buffer(b, "fill_buffer_with_block", "-", fill_buf, block_order);
+	bench_buffer(b, "fill_buffer_with_blocks", "-", fill_buf_batch,
+		block_order);
+
+	/* The buffer was filled with the expected blocks above. */
+	bench_buffer(b, "validate_buffer_with_block", "good", validate_buf,
+		block_order);
+
+	/* Blocks of another region of the drive. */
+	fill_buffer_with_blocks(b->buf, b->args->size >> block_order,
+		block_order, b->args->size, 0, false);
+	bench_buffer(b, "validate_buffer_with_block", "overwritten",
+		validate_buf, block_order);
+
+	/* Garbage. */
+	memset(b->buf, 0xA5, b->args->size);
+	bench_buffer(b, "validate_buffer_with_block", "bad", validate_buf,
+		block_order);
+}
+
+static void bench_file_device(struct bench *b, unsigned int block_order)
+{
+	const uint64_t size = b->args->size;
+	const uint64_t last_block = (size >> block_order) - 1;
+	struct device *dev;
+	char *filename;
+	uint64_t start, elapsed, rounds;
+	const size_t filename_len = strlen(b->args->dir) + 32;
+
+	filename = malloc(filename_len);
+	if (!filename)
+		err(errno, "Can't allocate the file name");
+	snprintf(filename, filename_len, "%s/f3bench-%u.fdev",
+		b->args->dir, block_order);
+	dev = create_file_device(filename, size, size, ilog2(size),
+		block_order, -1, false, false);
+	if (!dev)
+		errx(1, "Can't create the file device `%s'", filename);
+	free(filename);
+
+	fill_buffer_with_blocks(b->buf, last_block + 1, block_order, 0, 0,
+		false);
+
+	rounds = 0;
+	start = now_ns();
+	do {
+		assert(!dev_write_blocks(dev, b->buf, 0, last_block));
+		rounds++;
+		elapsed = now_ns() - start;
+	} while (elapsed < b->args->min_time_ns);
+	add_result(b, "file_device", "write", block_order,
+		rounds * 1000000000.0 / elapsed * size / GIGABYTE_SIZE, "GB/s");
+
+	rounds = 0;
+	start = now_ns();
+	do {
+		assert(!dev_read_blocks(dev, b->buf, 0, last_block));
+		rounds++;
+		elapsed = now_ns() - start;
+	} while (elapsed < b->args->min_time_ns);
+	add_result(b, "file_device", "read", block_order,
+		rounds * 1000000000.0 / elapsed * size / GIGABYTE_SIZE, "GB/s");
+
+	free_device(dev);
+}
+
+static void write_json(const struct bench *b, FILE *f)
+{
+	int i;
+
+	fprintf(f, "{\n\t\"version\": \"%s\",\n\t\"size_byte\": %" PRIu64
+		",\n\t\"results\": [\n", F3_STR_VERSION, b->args->size);
+	for (i = 0; i < b->n_results; i++) {
+		const struct result *r = &b->results[i];
+		fprintf(f, "\t\t{\"name\": \"%s\", \"input\": \"%s\", "
+			"\"block_order\": %u, \"value\": %.3f, "
+			"\"unit\": \"%s\"}%s\n",
+			r->name, r->input, r->block_order, r->value, r->unit,
+			i + 1 < b->n_results ? "," : "");
+	}
+	fprintf(f, "\t]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct args args = {
+		/* Defaults. */
+		.dir		= "/dev/shm",
+		.size		= 64 * MEGABYTE_SIZE,
+		.min_time_ns	= 500000000ULL,
+		.json_filename	= NULL,
+	};
+	static const unsigned int block_orders[] = {SECTOR_ORDER, 12, 16};
+	const int n_orders = sizeof(block_orders) / sizeof(block_orders[0]);
+	struct bench b;
+	int i;
+
+	/* Read parameters. */
+	argp_parse(&argp, argc, argv, 0, NULL, &args);
+	print_header(stdout, "bench");
+
+	b.args = &args;
+	b.n_results = 0;
+	b.buf = aligned_alloc(MEGABYTE_SIZE, args.size);
+	if (!b.buf)
+		err(errno, "Can't allocate the buffer");
+
+	printf("%-28s %-12s %5s %12s %s\n",
+		"CASE", "INPUT", "ORDER", "VALUE", "UNIT");
+
+	for (i = 0; i < n_orders; i++)
+		bench_pattern(&b, block_orders[i]);
+
+	fill_buffer_with_blocks(b.buf, args.size >> SECTOR_ORDER,
+		SECTOR_ORDER, 0, 0, false);
+	bench_buffer(&b, "check_buffer", "good", check_buf, SECTOR_ORDER);
+
+	add_result(&b, "dbuf_get_buf", "churn", SECTOR_ORDER,
+		run_bench(&b, churn_dbuf, SECTOR_ORDER) *
+		(ilog2(args.size) - SECTOR_ORDER + 1) / 1000000.0,
+		"Mcalls/s");
+
+	for (i = 0; i < n_orders; i++)
+		bench_file_device(&b, block_orders[i]);
+
+	if (args.json_filename) {
+		FILE *f = strcmp(args.json_filename, "-")
+			? fopen(args.json_filename, "w") : stdout;
+		if (!f)
+			err(errno, "Can't open `%s'", args.json_filename);
+		write_json(&b, f);
+		if (f != stdout)
+			fclose(f);
+	}
+
+	free(b.buf);
+	return 0;
+}
@@ -266,6 +266,7 @@ static void write_blocks(struct device *dev, struct flow *fw,
 {
 	const unsigned int block_size = dev_get_block_size(dev);
 	const unsigned int block_order = dev_get_block_order(dev);
+	const fill_block_fn fill_block = get_fill_block_fn(block_order);
 	uint64_t offset = first_block << block_order;
 	uint64_t first_pos = first_block;
 	struct dynamic_buffer dbuf;
@@ -288,7 +289,7 @@ static void write_blocks(struct device *dev, struct flow *fw,
 
 		stamp_blk = buffer;
 		for (pos = first_pos; pos < next_pos; pos++) {
-			fill_buffer_with_block(stamp_blk, block_order, offset, 0);
+			fill_block(stamp_blk, block_order, offset, 0);
 			stamp_blk += block_size;
 			offset += block_size;
 		}
@@ -1,5 +1,5 @@
-#define _POSIX_C_SOURCE 200112L
-#define _XOPEN_SOURCE 600
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
 
 #include <assert.h>
 #include <stdint.h>
@@ -18,10 +18,14 @@
 #include <sys/stat.h>
 #include <argp.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "libutils.h"
 #include "libfile.h"
 #include "libflow.h"
+#include "libpipe.h"
+#include "libjournal.h"
 #include "version.h"
 
 /* Argp's global variables. */
@@ -33,6 +37,9 @@ static char adoc[] = "<PATH>";
 static char doc[] = "F3 Read -- validate .h2w files to test "
 	"the real capacity of the drive";
 
+/* Maximum number of files validated concurrently. */
+#define MAX_JOBS	(16)
+
 static struct argp_option options[] = {
 	{"start-at",		's',	"NUM",		0,
 		"First NUM.h2w file to be read",			1},
@@ -40,6 +47,33 @@ static struct argp_option options[] = {
 		"Last NUM.h2w file to be read",				0},
 	{"max-read-rate",	'r',	"KB/s",		0,
 		"Maximum read rate",					0},
+	{"max-read-iops",	'i',	"NUM",		0,
+		"Maximum number of reads per second",			0},
+	{"burst",		'B',	"MS",		0,
+		"Let the reads run up to MS milliseconds ahead of the maximum rates",
+		0},
+	{"queue-depth",		'q',	"NUM",		0,
+		"Maximum number of reads in flight",			0},
+	{"direct",		'd',	NULL,		0,
+		"Bypass the page cache of the operating system",	0},
+	{"jobs",		'j',	"NUM",		0,
+		"Number of files validated concurrently",		0},
+	{"file-size",		'f',	"SIZE",		0,
+		"Size of the .h2w files; it is derived from the files by default",
+		0},
+	{"physical-order",	'P',	NULL,		0,
+		"Validate the files in the order of their locations on the drive, where the file system tells them",
+		0},
+	{"fix-cmd",		'x',	NULL,		0,
+		"Show how to call f3fix to fix the drive",	0},
+	{"bail-out",		'b',	"SECTORS",	0,
+		"After SECTORS lost sectors in a row, sample the rest of the files instead of reading them",
+		0},
+	{"journal",		'J',	"FILE",		0,
+		"Record the progress in FILE, which must not be on the drive",
+		0},
+	{"resume",		'R',	NULL,		0,
+		"Resume the run recorded in the journal, if any",	0},
 	{"show-progress",	'p',	"NUM",		0,
 		"Show progress if NUM is not zero",			0},
 	{ 0 }
@@ -49,6 +83,17 @@ struct args {
 	uint64_t    start_at;
 	uint64_t    end_at;
 	uint64_t    max_read_rate;
+	uint64_t    max_read_iops;
+	uint64_t    burst_ms;
+	unsigned int queue_depth;
+	bool	    direct;
+	unsigned int n_jobs;
+	unsigned int file_order;
+	bool	    physical_order;
+	bool	    fix_cmd;
+	uint64_t    bail_out;
+	const char  *journal_filename;
+	bool	    resume;
 	int	    show_progress;
 	const char  *dev_path;
 };
@@ -83,6 +128,78 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		args->max_read_rate = ll;
 		break;
 
+	case 'i':
+		ll = arg_to_ll_bytes(state, arg);
+		if (ll <= 0)
+			argp_error(state,
+				"NUM must be greater than zero");
+		args->max_read_iops = ll;
+		break;
+
+	case 'B':
+		ll = arg_to_ll_bytes(state, arg);
+		if (ll < 0)
+			argp_error(state,
+				"MS must be greater or equal to zero");
+		args->burst_ms = ll;
+		break;
+
+	case 'q':
+		ll = arg_to_ll_bytes(state, arg);
+		if (ll <= 0 || ll > IO_MAX_QUEUE_DEPTH)
+			argp_error(state,
+				"NUM must be in the interval [1, %i]",
+				IO_MAX_QUEUE_DEPTH);
+		args->queue_depth = ll;
+		break;
+
+	case 'd':
+		args->direct = true;
+		break;
+
+	case 'j':
+		ll = arg_to_ll_bytes(state, arg);
+		if (ll <= 0 || ll > MAX_JOBS)
+			argp_error(state,
+				"NUM must be in the interval [1, %i]",
+				MAX_JOBS);
+		args->n_jobs = ll;
+		break;
+
+	case 'f':
+		ll = arg_to_ll_bytes(state, arg);
+		if (ll <= 0 || !is_power_of_2(ll) ||
+				ilog2(ll) < MIN_FILE_ORDER ||
+				ilog2(ll) > MAX_FILE_ORDER)
+			argp_error(state,
+				"SIZE must be a power of 2 from 64M to 64G");
+		args->file_order = ilog2(ll);
+		break;
+
+	case 'P':
+		args->physical_order = true;
+		break;
+
+	case 'x':
+		args->fix_cmd = true;
+		break;
+
+	case 'b':
+		ll = arg_to_ll_bytes(state, arg);
+		if (ll < 0)
+			argp_error(state,
+				"SECTORS must be greater or equal to zero");
+		args->bail_out = ll;
+		break;
+
+	case 'J':
+		args->journal_filename = arg;
+		break;
+
+	case 'R':
+		args->resume = true;
+		break;
+
 	case 'p':
 		args->show_progress = !!arg_to_ll_bytes(state, arg);
 		break;
@@ -105,6 +222,9 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		if (args->start_at > args->end_at)
 			argp_error(state,
 				"Option --start-at must be less or equal to option --end-at");
+		if (args->resume && !args->journal_filename)
+			argp_error(state,
+				"Option --resume requires option --journal");
 		break;
 
 	default:
@@ -120,82 +240,412 @@ struct file_stats {
 
 	uint64_t bytes_read;
 	int read_all;
+	/* Bytes of @bytes_read whose stats were extrapolated from
+	 * @n_samples samples.
+	 */
+	uint64_t bytes_sampled;
+	unsigned int n_samples;
 };
 
-static inline void zero_fstats(struct file_stats *stats)
+static void check_buffer(char *buf, uint64_t sectors,
+	uint64_t *pexpected_offset, struct block_stats *stats, bool streaming)
 {
-	memset(stats, 0, sizeof(*stats));
+	validate_blocks_update_stats(buf, sectors, SECTOR_ORDER,
+		*pexpected_offset, 0, stats, streaming);
+	*pexpected_offset += sectors << SECTOR_ORDER;
 }
 
-static inline void check_sector(char *sector, uint64_t expected_offset,
-	struct file_stats *stats)
+/* The main thread reads a file into the slots of a pipeline while
+ * verifier threads validate the slots already read.
+ * This way, reads do not wait for the validation of sectors.
+ */
+
+#define MAX_VERIFIERS	(4)
+#define SLOT_SIZE	(4 * MEGABYTE_SIZE)
+
+static inline uint64_t lost_sectors(const struct block_stats *stats)
 {
-	uint64_t found_offset;
-	validate_block_update_stats(sector, SECTOR_ORDER, expected_offset,
-		&found_offset, 0, &stats->secs);
+	return stats->bad + stats->changed + stats->overwritten;
 }
 
-static void check_buffer(char *buf, uint64_t sectors,
-	uint64_t *pexpected_offset, struct file_stats *stats)
+/* With --bail-out, the verifiers of a job account the runs of sectors
+ * that are not good in the order of the slots, so runs are measured in
+ * sectors even when they cross slots.
+ */
+struct lost_runs {
+	pthread_mutex_t	lock;
+	/* Zero if there is no bail-out. */
+	uint64_t	max_run;
+	/* Sequence number of the next slot to account. */
+	uint64_t	next_seq;
+	/* Slots verified but not yet accounted; indexed by slot. */
+	struct lost_slot {
+		bool		verified;
+		bool		any_good;
+		/* Lost sectors before the first good sector of the slot,
+		 * or in the whole slot if no sector is good.
+		 */
+		uint64_t	lead;
+		/* Longest run between good sectors of the slot. */
+		uint64_t	longest;
+		/* Lost sectors after the last good sector of the slot. */
+		uint64_t	trail;
+	}		*slots;
+	unsigned int	n_slots;
+	/* Sectors in the current run. */
+	uint64_t	run;
+	/* The run reached @max_run. */
+	bool		bail_out;
+};
+
+static void init_lost_runs(struct lost_runs *runs, uint64_t max_run,
+	unsigned int n_slots)
 {
-	uint64_t i;
+	assert(!pthread_mutex_init(&runs->lock, NULL));
+	runs->max_run = max_run;
+	runs->next_seq = 0;
+	runs->slots = calloc(n_slots, sizeof(*runs->slots));
+	if (!runs->slots)
+		errx(1, "Can't allocate the runs");
+	runs->n_slots = n_slots;
+	runs->run = 0;
+	runs->bail_out = false;
+}
+
+static void free_lost_runs(struct lost_runs *runs)
+{
+	free(runs->slots);
+	pthread_mutex_destroy(&runs->lock);
+}
+
+/* Slots are numbered from zero for each file, but runs cross files. */
+static inline void start_lost_runs(struct lost_runs *runs)
+{
+	runs->next_seq = 0;
+}
+
+/* Find the runs of lost sectors of @buf, which has @sectors sectors
+ * from @offset on, and some good and some lost sectors.
+ */
+static void find_lost_runs(const char *buf, uint64_t sectors,
+	uint64_t offset, struct lost_slot *ls)
+{
+	uint64_t i, run = 0, found_offset;
+
+	ls->lead = UINT64_MAX;
+	ls->longest = 0;
 	for (i = 0; i < sectors; i++) {
-		check_sector(buf, *pexpected_offset, stats);
-		buf += SECTOR_SIZE;
-		*pexpected_offset += SECTOR_SIZE;
+		if (validate_buffer_with_block(buf + (i << SECTOR_ORDER),
+				SECTOR_ORDER, offset + (i << SECTOR_ORDER),
+				&found_offset, 0) != bs_good) {
+			run++;
+			continue;
+		}
+		if (ls->lead == UINT64_MAX)
+			ls->lead = run;
+		else if (run > ls->longest)
+			ls->longest = run;
+		run = 0;
 	}
+	assert(ls->lead != UINT64_MAX);
+	ls->trail = run;
 }
 
-static int read_all(int fd, char *buf, size_t *pbytes)
+/* A slot is not taken again before the slots before it are verified,
+ * so the slots verified but not yet accounted fit in the ring.
+ */
+static void account_slot(struct lost_runs *runs, const struct pl_slot *slot,
+	const struct block_stats *before, const struct block_stats *after)
 {
-	ssize_t rc;
-	size_t done = 0;
-	do {
-		rc = read(fd, buf + done, *pbytes - done);
-		if (rc < 0) {
-			if (errno == EINTR)
-				continue;
-			rc = errno;
-			goto out;
+	const uint64_t sectors = slot->len >> SECTOR_ORDER;
+	struct lost_slot *ls;
+	struct lost_slot found;
+
+	if (!runs->max_run)
+		return;
+
+	/* Only slots with both good and lost sectors need a closer look;
+	 * this is done before taking the lock.
+	 */
+	found.any_good = after->ok > before->ok;
+	if (!found.any_good) {
+		found.lead = sectors;
+		found.longest = 0;
+		found.trail = 0;
+	} else if (lost_sectors(after) > lost_sectors(before)) {
+		find_lost_runs(slot->buf, sectors, slot->offset, &found);
+	} else {
+		found.lead = 0;
+		found.longest = 0;
+		found.trail = 0;
+	}
+
+	assert(!pthread_mutex_lock(&runs->lock));
+	assert(slot->seq - runs->next_seq < runs->n_slots);
+	ls = &runs->slots[slot->seq % runs->n_slots];
+	*ls = found;
+	ls->verified = true;
+
+	ls = &runs->slots[runs->next_seq % runs->n_slots];
+	while (ls->verified) {
+		runs->run += ls->lead;
+		if (runs->run >= runs->max_run || ls->longest >= runs->max_run)
+			runs->bail_out = true;
+		if (ls->any_good)
+			runs->run = ls->trail;
+		if (runs->run >= runs->max_run)
+			runs->bail_out = true;
+		ls->verified = false;
+		runs->next_seq++;
+		ls = &runs->slots[runs->next_seq % runs->n_slots];
+	}
+	assert(!pthread_mutex_unlock(&runs->lock));
+}
+
+static bool must_bail_out(struct lost_runs *runs)
+{
+	bool bail_out;
+
+	if (!runs->max_run)
+		return false;
+	assert(!pthread_mutex_lock(&runs->lock));
+	bail_out = runs->bail_out;
+	assert(!pthread_mutex_unlock(&runs->lock));
+	return bail_out;
+}
+
+static void set_bail_out(struct lost_runs *runs)
+{
+	assert(!pthread_mutex_lock(&runs->lock));
+	runs->bail_out = true;
+	assert(!pthread_mutex_unlock(&runs->lock));
+}
+
+struct verifier {
+	struct pipeline		*pl;
+	struct lost_runs	*runs;
+	struct block_stats	stats;
+	/* The lost sectors validated are within [first_lost, end_lost),
+	 * as offsets of the drive that the files emulate.
+	 */
+	uint64_t		first_lost;
+	uint64_t		end_lost;
+	/* The slots are validated long after they are read, so
+	 * the loads bypass the cache when the slots do not fit in it.
+	 */
+	bool			streaming;
+	pthread_t		thread;
+};
+
+/* Extend [*pfirst_lost, *pend_lost) to the lost sectors of @buf,
+ * which has @sectors sectors from @offset on.
+ */
+static void bound_lost_sectors(const char *buf, uint64_t sectors,
+	uint64_t offset, uint64_t *pfirst_lost, uint64_t *pend_lost)
+{
+	uint64_t first, last, found_offset;
+
+	for (first = 0; first < sectors; first++) {
+		if (validate_buffer_with_block(buf + (first << SECTOR_ORDER),
+				SECTOR_ORDER, offset + (first << SECTOR_ORDER),
+				&found_offset, 0) != bs_good)
+			break;
+	}
+	if (first == sectors)
+		return;
+	for (last = sectors - 1; last > first; last--) {
+		if (validate_buffer_with_block(buf + (last << SECTOR_ORDER),
+				SECTOR_ORDER, offset + (last << SECTOR_ORDER),
+				&found_offset, 0) != bs_good)
+			break;
+	}
+
+	if (offset + (first << SECTOR_ORDER) < *pfirst_lost)
+		*pfirst_lost = offset + (first << SECTOR_ORDER);
+	if (offset + ((last + 1) << SECTOR_ORDER) > *pend_lost)
+		*pend_lost = offset + ((last + 1) << SECTOR_ORDER);
+}
+
+static void *verify_file(void *arg)
+{
+	struct verifier *ver = arg;
+	struct pl_slot *slot;
+
+	while ((slot = pl_get_full(ver->pl)) != NULL) {
+		uint64_t expected_offset = slot->offset;
+		const struct block_stats before = ver->stats;
+		check_buffer(slot->buf, slot->len >> SECTOR_ORDER,
+			&expected_offset, &ver->stats, ver->streaming);
+		if (lost_sectors(&ver->stats) > lost_sectors(&before)) {
+			bound_lost_sectors(slot->buf, slot->len >> SECTOR_ORDER,
+				slot->offset, &ver->first_lost,
+				&ver->end_lost);
 		}
-		if (rc == 0)
-			goto out;
-		done += rc;
-	} while (done < *pbytes);
-	rc = 0;
-
-out:
-	*pbytes = done;
-	return rc;
+		account_slot(ver->runs, slot, &before, &ver->stats);
+		pl_put_free(ver->pl, slot);
+	}
+	return NULL;
 }
 
-static int check_chunk(struct flow *fw, struct dynamic_buffer *dbuf,
-	int fd, uint64_t *pexpected_offset, struct file_stats *stats,
-	size_t *ptot_bytes_read)
+/* The main thread keeps up to queue_depth reads in flight. */
+struct reader {
+	struct pipeline		*pl;
+	struct io_engine	*eng;
+	int			fd;
+	/* Bypass the page cache. */
+	bool			direct;
+	/* Shared by all readers. */
+	struct pacer		*pacer;
+	/* Position in the file of the next read. */
+	uint64_t		pos;
+	/* Size of the file; no read goes past it, so the pacer only
+	 * accounts for bytes that are read.
+	 */
+	uint64_t		size;
+
+	/* Requests not in flight. */
+	struct io_req		*reqs;
+	struct io_req		**free_reqs;
+	unsigned int		n_free_reqs;
+};
+
+static void init_reader(struct reader *rd, struct pipeline *pl,
+	unsigned int queue_depth, bool direct, struct pacer *pacer)
+{
+	char *bufs[pl->n_slots];
+	unsigned int i;
+
+	for (i = 0; i < pl->n_slots; i++)
+		bufs[i] = pl->slots[i].buf;
+	rd->eng = create_io_engine(queue_depth, bufs, pl->n_slots,
+		pl_get_slot_size(pl));
+	if (!rd->eng)
+		errx(1, "Can't create the I/O engine");
+
+	rd->pl = pl;
+	rd->direct = direct;
+	rd->pacer = pacer;
+	rd->reqs = calloc(queue_depth, sizeof(*rd->reqs));
+	rd->free_reqs = calloc(queue_depth, sizeof(*rd->free_reqs));
+	if (!rd->reqs || !rd->free_reqs)
+		errx(1, "Can't allocate the reader");
+	for (i = 0; i < queue_depth; i++)
+		rd->free_reqs[i] = &rd->reqs[i];
+	rd->n_free_reqs = queue_depth;
+}
+
+static void free_reader(struct reader *rd)
+{
+	free_io_engine(rd->eng);
+	free(rd->free_reqs);
+	free(rd->reqs);
+}
+
+static inline void start_reader(struct reader *rd, int fd, uint64_t pos,
+	uint64_t size)
+{
+	rd->fd = fd;
+	rd->pos = pos;
+	rd->size = size;
+}
+
+/* Return true if taking the next free slot cannot wait for a read in
+ * flight. Reads finish out of order, so the oldest slot still being read
+ * may be a whole ring behind.
+ */
+static bool can_submit_read(const struct reader *rd)
+{
+	const uint64_t next_seq = pl_next_produce_seq(rd->pl);
+	unsigned int i;
+
+	if (io_is_full(rd->eng))
+		return false;
+	for (i = 0; i < rd->eng->queue_depth; i++) {
+		const struct pl_slot *slot = rd->reqs[i].data;
+		if (slot && next_seq - slot->seq >= rd->pl->n_slots)
+			return false;
+	}
+	return true;
+}
+
+/* Submit the read of the next slot of the chunk. */
+static int submit_read(struct reader *rd, uint64_t *pchunk_size,
+	uint64_t *pexpected_offset)
+{
+	struct pl_slot *slot = pl_get_free(rd->pl);
+	struct io_req *req;
+	int rc;
+
+	assert(slot);
+	assert(rd->n_free_reqs > 0);
+	req = rd->free_reqs[--rd->n_free_reqs];
+	req->op = IO_OP_READ;
+	req->fd = rd->fd;
+	req->buf = slot->buf;
+	req->len = MIN(*pchunk_size, pl_get_slot_size(rd->pl));
+	req->len = MIN(req->len, rd->size - rd->pos);
+	req->offset = rd->pos;
+	req->buf_index = pl_slot_index(rd->pl, slot);
+	req->data = slot;
+	slot->offset = *pexpected_offset;
+
+	pace(rd->pacer, req->len);
+	rc = io_submit(rd->eng, req);
+	if (rc) {
+		req->data = NULL;
+		rd->free_reqs[rd->n_free_reqs++] = req;
+		/* Slots must be handed to the verifiers in order,
+		 * even when they are empty.
+		 */
+		slot->len = 0;
+		pl_put_full(rd->pl, slot);
+		return rc;
+	}
+
+	rd->pos += req->len;
+	*pexpected_offset += req->len;
+	*pchunk_size -= req->len;
+	return 0;
+}
+
+/* A bail-out ends the chunk early, as the end of the file does. */
+static int check_chunk(struct flow *fw, struct reader *rd,
+	struct lost_runs *runs, uint64_t *pexpected_offset,
+	struct file_stats *stats, size_t *ptot_bytes_read)
 {
 	uint64_t chunk_size = get_rem_chunk_blocks(fw) <<
 		fw_get_block_order(fw);
-	size_t len = chunk_size;
-	char * const buf = dbuf_get_buf(dbuf, 0, &len);
 	size_t tot_bytes_read = 0;
+	bool short_read = false;
 	int rc = 0;
+	struct io_req *req;
 
-	while (chunk_size > 0) {
-		size_t bytes_read = MIN(chunk_size, len);
-		rc = read_all(fd, buf, &bytes_read);
-		tot_bytes_read += bytes_read;
+	do {
+		/* Keep the queue full. */
+		while (!rc && !short_read && chunk_size > 0 &&
+				rd->pos < rd->size && can_submit_read(rd) &&
+				!must_bail_out(runs))
+			rc = submit_read(rd, &chunk_size, pexpected_offset);
 
-		if (bytes_read == 0)
+		req = io_wait(rd->eng);
+		if (!req)
 			break;
 
-		chunk_size -= bytes_read;
-		assert((bytes_read & (SECTOR_SIZE - 1)) == 0);
-		check_buffer(buf, bytes_read >> SECTOR_ORDER,
-			pexpected_offset, stats);
+		/* Reads that finish early, either because of an error or
+		 * the end of the file, end the chunk.
+		 */
+		if (req->res < req->len)
+			short_read = true;
+		assert((req->res & (SECTOR_SIZE - 1)) == 0);
+		tot_bytes_read += req->res;
+		if (!rc)
+			rc = req->err;
 
-		if (rc != 0)
-			break;
-	}
+		((struct pl_slot *)req->data)->len = req->res;
+		pl_put_full(rd->pl, req->data);
+		req->data = NULL;
+		rd->free_reqs[rd->n_free_reqs++] = req;
+	} while (true);
 
 	stats->bytes_read += tot_bytes_read;
 	*ptot_bytes_read = tot_bytes_read;
@@ -209,38 +659,597 @@ static inline void print_status(const struct file_stats *stats)
 		stats->secs.overwritten);
 }
 
-static void validate_file(struct flow *fw, struct dynamic_buffer *dbuf,
-	const char *path, uint64_t number, struct file_stats *stats)
+/* Several jobs validate files concurrently; each job has its own flow,
+ * pipeline, reader, and verifiers. The results of the files are kept
+ * until all the files before them are reported, so they are reported
+ * in order.
+ */
+
+struct file_result {
+	struct file_stats	stats;
+	int			saved_errno;
+	uint64_t		file_time_ns;
+	double			file_min_speed;
+	double			file_max_speed;
+	uint64_t		file_tot_blocks;
+	uint64_t		file_tot_time_ns;
+	uint64_t		file_speed_samples;
+	/* With --fix-cmd, the lowest offset on the drive of the lost
+	 * sectors of the file, or UINT64_MAX; and zero or the errno value
+	 * of the failure to find it.
+	 */
+	uint64_t		lost_at;
+	int			lost_at_errno;
+	bool			done;
+};
+
+/* Seconds between checkpoints of a file in the journal. */
+#define CHECKPOINT_INTERVAL_NS	(5 * 1000000000ULL)
+
+/* A file that was being validated when the journal was saved. */
+struct partial_file {
+	uint64_t		number;
+	/* Bytes of the file already validated, and their stats. */
+	uint64_t		pos;
+	struct file_stats	stats;
+};
+
+/* The content of the journal of f3read. */
+struct read_journal {
+	unsigned int		file_order;
+	uint64_t		start_at;
+	uint64_t		end_at;
+	/* Totals of the files reported before file @number. */
+	uint64_t		number;
+	struct block_stats	tot_stats;
+	uint64_t		tot_size;
+	int			and_read_all;
+	int			or_missing_file;
+	uint64_t		tot_sampled;
+	bool			sampling;
+	uint64_t		lost_at;
+	int			lost_at_errno;
+	/* Measurements of the flow. */
+	uint64_t		blocks;
+	uint64_t		time_ns;
+	struct partial_file	partials[MAX_JOBS];
+	unsigned int		n_partials;
+};
+
+/* Where the file system is on its disk, for --fix-cmd. */
+struct fix_location {
+	/* Zero or the errno value of locate_file_system(). */
+	int			rc;
+	char			disk[PATH_MAX];
+	uint64_t		start_sector;
+};
+
+/* State shared by all jobs. */
+struct read_state {
+	/* Protects the fields below and the output. */
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+
+	const char		*path;
+	int			dir_fd;
+	const uint64_t		*files;
+	uint64_t		n_files;
+	/* Indexes in @files in the order to validate the files,
+	 * or NULL for the order of @files.
+	 */
+	const uint64_t		*schedule;
+	unsigned int		n_jobs;
+	/* The size of the files is 2^file_order bytes. */
+	unsigned int		file_order;
+	/* Indexes in @files of the next file to validate and to report. */
+	uint64_t		next_file;
+	uint64_t		next_report;
+	unsigned int		n_running;
+	struct file_result	*results;
+
+	/* Blocks read by all jobs, and their aggregated flow. */
+	uint64_t		read_blocks;
+	struct flow		agg_fw;
+
+	/* Totals of the files already reported. */
+	struct block_stats	tot_stats;
+	uint64_t		tot_size;
+	int			and_read_all;
+	int			or_missing_file;
+	uint64_t		tot_sampled;
+	/* Next file number expected to be reported. */
+	uint64_t		number;
+	/* Number after the last file reported. */
+	uint64_t		reported_number;
+
+	/* NULL if there is no journal. */
+	struct journal		*journal;
+	uint64_t		start_at;
+	uint64_t		end_at;
+	struct job		*jobs;
+	/* Files of the resumed run that are partially validated. */
+	const struct partial_file *partials;
+	unsigned int		n_partials;
+
+	/* A job bailed out, so the rest of the files are sampled. */
+	bool			sampling;
+
+	/* Where the file system is on its disk; NULL without --fix-cmd. */
+	const struct fix_location *fix;
+	/* The lowest of file_result.lost_at of the files reported, and
+	 * the first of their file_result.lost_at_errno that is not zero.
+	 */
+	uint64_t		lost_at;
+	int			lost_at_errno;
+};
+
+struct job {
+	struct read_state	*rs;
+	unsigned int		n_verifiers;
+	struct flow		fw;
+	struct pipeline		pl;
+	struct reader		rd;
+	struct lost_runs	runs;
+	pthread_t		thread;
+
+	/* The file being validated, if busy, as of the last checkpoint;
+	 * protected by rs->lock.
+	 */
+	bool			busy;
+	struct partial_file	file;
+	struct timespec		last_checkpoint;
+};
+
+/* Index in rs->files of the @i-th file to validate. */
+static inline uint64_t file_index(const struct read_state *rs, uint64_t i)
+{
+	return rs->schedule ? rs->schedule[i] : i;
+}
+
+/* A single job validating the files in order announces a file before
+ * validating it. Otherwise, report_files() announces it.
+ */
+static inline bool announces_early(const struct read_state *rs)
+{
+	return rs->n_jobs == 1 && !rs->schedule;
+}
+
+static void print_journal_error(int rc)
+{
+	errx(1, "Can't save the journal: %s", strerror(rc));
+}
+
+/* The caller must hold rs->lock. */
+static void save_journal(struct read_state *rs)
+{
+	const struct flow *fw = rs->n_jobs == 1
+		? &rs->jobs[0].fw : &rs->agg_fw;
+	const struct block_stats *tot = &rs->tot_stats;
+	uint64_t blocks, time_ns;
+	unsigned int i;
+	int rc;
+	FILE *f;
+
+	if (!rs->journal)
+		return;
+	f = journal_start(rs->journal);
+	if (!f)
+		print_journal_error(errno);
+
+	fw_get_measurements(fw, &blocks, &time_ns);
+	fprintf(f, "f3read 1\n");
+	fprintf(f, "file_order %u\n", rs->file_order);
+	fprintf(f, "range %" PRIu64 " %" PRIu64 "\n",
+		rs->start_at, rs->end_at);
+	fprintf(f, "number %" PRIu64 "\n", rs->reported_number);
+	fprintf(f, "totals %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+		" %" PRIu64 " %i %i\n", tot->ok, tot->bad, tot->changed,
+		tot->overwritten, rs->tot_size, rs->and_read_all,
+		rs->or_missing_file);
+	fprintf(f, "measured %" PRIu64 " %" PRIu64 "\n", blocks, time_ns);
+	fprintf(f, "sampled %" PRIu64 " %i\n", rs->tot_sampled, rs->sampling);
+	if (rs->fix) {
+		fprintf(f, "lost_at %" PRIu64 " %i\n",
+			rs->lost_at, rs->lost_at_errno);
+	}
+	for (i = 0; i < rs->n_jobs; i++) {
+		const struct partial_file *pf = &rs->jobs[i].file;
+		if (!rs->jobs[i].busy || pf->pos == 0)
+			continue;
+		fprintf(f, "partial %" PRIu64 " %" PRIu64 " %" PRIu64
+			" %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+			pf->number, pf->pos, pf->stats.secs.ok,
+			pf->stats.secs.bad, pf->stats.secs.changed,
+			pf->stats.secs.overwritten);
+	}
+	/* Partial files of the resumed run not yet taken by a job. */
+	for (i = 0; i < rs->n_partials; i++) {
+		const struct partial_file *pf = &rs->partials[i];
+		uint64_t j;
+		for (j = rs->next_file; j < rs->n_files; j++) {
+			if (rs->files[file_index(rs, j)] == pf->number)
+				break;
+		}
+		if (j == rs->n_files)
+			continue;
+		fprintf(f, "partial %" PRIu64 " %" PRIu64 " %" PRIu64
+			" %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+			pf->number, pf->pos, pf->stats.secs.ok,
+			pf->stats.secs.bad, pf->stats.secs.changed,
+			pf->stats.secs.overwritten);
+	}
+
+	rc = journal_commit(rs->journal, f);
+	if (rc)
+		print_journal_error(rc);
+}
+
+/* Return false if there is no journal. */
+static bool load_journal(const struct journal *j, struct read_journal *rj)
 {
+	FILE *f = journal_open(j);
+	char line[256];
+	unsigned int fields = 0;
+
+	if (!f) {
+		if (errno == ENOENT)
+			return false;
+		err(errno, "Can't open the journal");
+	}
+
+	memset(rj, 0, sizeof(*rj));
+	/* Journals of runs without --fix-cmd do not locate lost sectors. */
+	rj->lost_at = UINT64_MAX;
+	rj->lost_at_errno = ENODATA;
+	if (!fgets(line, sizeof(line), f) || strcmp(line, "f3read 1\n"))
+		errx(1, "The journal is not from f3read");
+	while (fgets(line, sizeof(line), f)) {
+		struct partial_file *pf = &rj->partials[rj->n_partials];
+		struct block_stats *tot = &rj->tot_stats;
+		int sampling;
+
+		if (sscanf(line, "file_order %u", &rj->file_order) == 1) {
+			fields |= 1;
+		} else if (sscanf(line, "range %" SCNu64 " %" SCNu64,
+				&rj->start_at, &rj->end_at) == 2) {
+			fields |= 2;
+		} else if (sscanf(line, "number %" SCNu64,
+				&rj->number) == 1) {
+			fields |= 4;
+		} else if (sscanf(line, "totals %" SCNu64 " %" SCNu64
+				" %" SCNu64 " %" SCNu64 " %" SCNu64 " %i %i",
+				&tot->ok, &tot->bad, &tot->changed,
+				&tot->overwritten, &rj->tot_size,
+				&rj->and_read_all,
+				&rj->or_missing_file) == 7) {
+			fields |= 8;
+		} else if (sscanf(line, "measured %" SCNu64 " %" SCNu64,
+				&rj->blocks, &rj->time_ns) == 2) {
+		} else if (sscanf(line, "sampled %" SCNu64 " %i",
+				&rj->tot_sampled, &sampling) == 2) {
+			rj->sampling = sampling;
+		} else if (sscanf(line, "lost_at %" SCNu64 " %i",
+				&rj->lost_at, &rj->lost_at_errno) == 2) {
+		} else if (rj->n_partials < MAX_JOBS &&
+				sscanf(line, "partial %" SCNu64 " %" SCNu64
+				" %" SCNu64 " %" SCNu64 " %" SCNu64
+				" %" SCNu64, &pf->number, &pf->pos,
+				&pf->stats.secs.ok, &pf->stats.secs.bad,
+				&pf->stats.secs.changed,
+				&pf->stats.secs.overwritten) == 6) {
+			pf->stats.bytes_read = pf->pos;
+			rj->n_partials++;
+		} else {
+			errx(1, "Invalid line in the journal: %s", line);
+		}
+	}
+	fclose(f);
+
+	if (fields != 15 || rj->file_order < MIN_FILE_ORDER ||
+			rj->file_order > MAX_FILE_ORDER)
+		errx(1, "The journal is incomplete");
+	return true;
+}
+
+/* Serialize the output of jobs, and erase the aggregated progress. */
+static void lock_output(struct read_state *rs)
+{
+	assert(!pthread_mutex_lock(&rs->lock));
+	clear_progress(&rs->agg_fw);
+}
+
+static void unlock_output(struct read_state *rs)
+{
+	fflush(stdout);
+	assert(!pthread_mutex_unlock(&rs->lock));
+}
+
+/* Report the files missing before file @number, and announce the file.
+ * The caller must hold rs->lock.
+ */
+static void start_file_report(struct read_state *rs, uint64_t number)
+{
+	char filename[MY_FILENAME_SIZE];
+
+	rs->or_missing_file = rs->or_missing_file || (number != rs->number);
+	for (; rs->number < number; rs->number++) {
+		printf("Missing file %s\n",
+			filename_from_number(filename, rs->number));
+	}
+	rs->number++;
+
+	printf("Validating file %s ... ", filename_from_number(filename, number));
+}
+
+static void print_file_result(const struct file_result *res,
+	unsigned int block_order)
+{
+	const struct file_stats *stats = &res->stats;
+	const unsigned int block_size = 1U << block_order;
+
+	print_status(stats);
+	if (!stats->read_all) {
+		assert(res->saved_errno != 0);
+		printf(" - NOT fully read due to \"%s\"",
+			strerror(res->saved_errno));
+	} else if (res->saved_errno != 0) {
+		printf(" - %s", strerror(res->saved_errno));
+	} else if (stats->bytes_sampled > 0) {
+		double f = (double)stats->bytes_sampled;
+		const char *unit = adjust_unit(&f);
+		printf(" - %.2f %s extrapolated from %u samples",
+			f, unit, stats->n_samples);
+	} else if (stats->bytes_read > 0) {
+		uint64_t file_time_ns = res->file_time_ns;
+		double file_avg_speed;
+
+		if (res->file_speed_samples >= 2) {
+			file_avg_speed = calc_avg_speed(block_order,
+				res->file_tot_blocks, res->file_tot_time_ns);
+			print_avg_min_max_samples(" ", "",
+				file_avg_speed, res->file_min_speed,
+				res->file_max_speed, res->file_speed_samples);
+		} else if (file_time_ns > 0) {
+			const uint64_t blocks_read =
+				stats->bytes_read >> block_order;
+			assert((stats->bytes_read & (block_size - 1)) == 0);
+			if (res->file_tot_blocks == blocks_read &&
+					res->file_tot_time_ns > 0) {
+				file_time_ns = res->file_tot_time_ns;
+			}
+			file_avg_speed = calc_avg_speed(block_order,
+				blocks_read, file_time_ns);
+			const char *unit = adjust_unit(&file_avg_speed);
+			printf(" Avg: %.2f %s/s", file_avg_speed, unit);
+		}
+	}
+	printf("\n");
+}
+
+/* Report, in order, the files whose validation is done.
+ * The caller must hold rs->lock.
+ */
+static void report_files(struct read_state *rs)
+{
+	const unsigned int block_order = fw_get_block_order(&rs->agg_fw);
+
+	while (rs->next_report < rs->n_files &&
+			rs->results[rs->next_report].done) {
+		const struct file_result *res =
+			&rs->results[rs->next_report];
+
+		if (!announces_early(rs))
+			start_file_report(rs, rs->files[rs->next_report]);
+		print_file_result(res, block_order);
+
+		rs->tot_stats.ok += res->stats.secs.ok;
+		rs->tot_stats.bad += res->stats.secs.bad;
+		rs->tot_stats.changed += res->stats.secs.changed;
+		rs->tot_stats.overwritten += res->stats.secs.overwritten;
+		rs->tot_size += res->stats.bytes_read;
+		rs->tot_sampled += res->stats.bytes_sampled;
+		rs->and_read_all = rs->and_read_all && res->stats.read_all;
+		if (res->lost_at < rs->lost_at)
+			rs->lost_at = res->lost_at;
+		if (!rs->lost_at_errno)
+			rs->lost_at_errno = res->lost_at_errno;
+		rs->reported_number = rs->files[rs->next_report] + 1;
+		rs->next_report++;
+	}
+}
+
+/* Wait for the verifiers to catch up with the reader, and record
+ * the file in the journal.
+ */
+static void checkpoint(struct job *job, const struct verifier *verifiers,
+	const struct file_stats *stats)
+{
+	struct read_state *rs = job->rs;
+	struct partial_file file;
+	unsigned int i;
+
+	pl_wait_drained(job->rd.pl);
+	file.number = job->file.number;
+	file.pos = job->rd.pos;
+	file.stats = *stats;
+	for (i = 0; i < job->n_verifiers; i++) {
+		file.stats.secs.ok += verifiers[i].stats.ok;
+		file.stats.secs.bad += verifiers[i].stats.bad;
+		file.stats.secs.changed += verifiers[i].stats.changed;
+		file.stats.secs.overwritten += verifiers[i].stats.overwritten;
+	}
+
+	assert(!pthread_mutex_lock(&rs->lock));
+	job->file = file;
+	save_journal(rs);
+	assert(!pthread_mutex_unlock(&rs->lock));
+	assert(!clock_gettime(CLOCK_MONOTONIC, &job->last_checkpoint));
+}
+
+/* After a bail-out, the rest of each file is sampled instead of read.
+ * As probabilistic_test() in libprobe.c shows, if at least 5% of
+ * the blocks are lost, 64 random blocks find a lost block with
+ * probability of at least 96.2%.
+ */
+#define N_SAMPLES	(64)
+
+static inline uint64_t uint64_rand(void)
+{
+	/* See uint64_rand() in libprobe.c. */
+	return ((uint64_t)rand() << 32) ^ rand();
+}
+
+static int uint64_cmp(const void *pa, const void *pb)
+{
+	const uint64_t *pia = pa;
+	const uint64_t *pib = pb;
+	return *pia < *pib ? -1 : *pia > *pib;
+}
+
+/* Sample the blocks of @fd from byte @pos to the end of the file, where
+ * the block at @pos is expected at @expected_offset, and add the stats
+ * extrapolated from the samples to @stats.
+ * Return zero or an errno value.
+ */
+static int sample_file(struct job *job, int fd, uint64_t pos,
+	uint64_t expected_offset, struct file_stats *stats)
+{
+	struct read_state *rs = job->rs;
+	const unsigned int block_order = fw_get_block_order(&job->fw);
+	const unsigned int block_size = 1U << block_order;
+	struct block_stats samples = {0, 0, 0, 0};
+	uint64_t blocks[N_SAMPLES];
+	uint64_t first, n_blocks, sectors, sampled, lost;
+	unsigned int i, n;
+	struct stat st;
+	char *buf;
+	int rc = 0;
+
+	if (fstat(fd, &st))
+		return errno;
+	if ((uint64_t)st.st_size <= pos)
+		return 0;
+	assert((pos & (block_size - 1)) == 0);
+	first = pos >> block_order;
+	n_blocks = (st.st_size >> block_order) - first;
+
+	if (n_blocks <= N_SAMPLES) {
+		n = n_blocks;
+		for (i = 0; i < n; i++)
+			blocks[i] = first + i;
+	} else {
+		n = N_SAMPLES;
+		/* rand() is only called with the lock held. */
+		assert(!pthread_mutex_lock(&rs->lock));
+		for (i = 0; i < n; ) {
+			uint64_t r = first + uint64_rand() % n_blocks;
+			unsigned int j;
+			for (j = 0; j < i && blocks[j] != r; j++)
+				;
+			if (j == i)
+				blocks[i++] = r;
+		}
+		assert(!pthread_mutex_unlock(&rs->lock));
+		/* Read the samples in order. */
+		qsort(blocks, n, sizeof(*blocks), uint64_cmp);
+	}
+
+	/* The file may bypass the page cache. */
+	buf = aligned_alloc(block_size, block_size);
+	if (!buf)
+		errx(1, "Can't allocate the buffer of the samples");
+	for (i = 0; i < n; i++) {
+		const uint64_t offset = blocks[i] << block_order;
+		uint64_t sample_offset = expected_offset + offset - pos;
+		ssize_t ret = pread(fd, buf, block_size, offset);
+		if (ret < 0) {
+			rc = errno;
+			break;
+		}
+		if (ret < block_size) {
+			rc = EIO;
+			break;
+		}
+		check_buffer(buf, block_size >> SECTOR_ORDER, &sample_offset,
+			&samples, false);
+	}
+	free(buf);
+	if (rc)
+		return rc;
+
+	sectors = n_blocks << (block_order - SECTOR_ORDER);
+	sampled = (uint64_t)n << (block_order - SECTOR_ORDER);
+	stats->secs.bad += samples.bad * sectors / sampled;
+	stats->secs.changed += samples.changed * sectors / sampled;
+	stats->secs.overwritten += samples.overwritten * sectors / sampled;
+	lost = (samples.bad * sectors / sampled) +
+		(samples.changed * sectors / sampled) +
+		(samples.overwritten * sectors / sampled);
+	stats->secs.ok += sectors - lost;
+	stats->bytes_read += sectors << SECTOR_ORDER;
+	stats->bytes_sampled += sectors << SECTOR_ORDER;
+	stats->n_samples += n;
+	return 0;
+}
+
+/* Validate the file of @job from the position of the file on. */
+static void validate_file(struct job *job, struct file_result *res)
+{
+	struct read_state *rs = job->rs;
+	struct flow *fw = &job->fw;
+	struct reader *rd = &job->rd;
+	struct file_stats *stats = &res->stats;
+	const uint64_t number = job->file.number;
+	const uint64_t start_pos = job->file.pos;
+	const uint64_t file_offset = number << rs->file_order;
 	const unsigned int block_size = fw_get_block_size(fw);
 	const unsigned int block_order = fw_get_block_order(fw);
-	double file_min_speed = INFINITY;
-	double file_max_speed = -INFINITY;
-	uint64_t file_tot_blocks = 0;
-	uint64_t file_tot_time_ns = 0;
-	uint64_t file_speed_samples = 0;
-	char *full_fn;
-	const char *filename;
+	char filename[MY_FILENAME_SIZE];
 	int fd, saved_errno;
-	uint64_t expected_offset;
+	uint64_t expected_offset, first_lost, end_lost;
+	struct verifier verifiers[MAX_VERIFIERS];
+	unsigned int i;
+	bool sampling;
+	struct stat st;
 	struct timespec file_t1, file_t2;
 
-	zero_fstats(stats);
+	/* Resume from the stats of the journal. */
+	*stats = job->file.stats;
+	stats->read_all = false;
+	res->file_min_speed = INFINITY;
+	res->file_max_speed = -INFINITY;
+	res->file_tot_blocks = 0;
+	res->file_tot_time_ns = 0;
+	res->file_speed_samples = 0;
+	res->lost_at = UINT64_MAX;
+	res->lost_at_errno = 0;
 
-	full_fn = full_fn_from_number(&filename, path, number);
-	assert(full_fn);
-	printf("Validating file %s ... ", filename);
-	fflush(stdout);
+	/* The journal does not tell where the lost sectors of
+	 * a partial file are, so assume anywhere before @start_pos.
+	 */
+	first_lost = UINT64_MAX;
+	end_lost = 0;
+	if (lost_sectors(&stats->secs) > 0) {
+		first_lost = file_offset;
+		end_lost = file_offset + start_pos;
+	}
+
+	filename_from_number(filename, number);
+	if (announces_early(rs)) {
+		lock_output(rs);
+		start_file_report(rs, number);
+		unlock_output(rs);
+	}
 #ifdef __CYGWIN__
 	/* We don't need write access, but some kernels require that
 	 * the file descriptor passed to fdatasync(2) to be writable.
 	 */
-	fd = open(full_fn, O_RDWR);
+	fd = openat(rs->dir_fd, filename, O_RDWR);
 #else
-	fd = open(full_fn, O_RDONLY);
+	fd = openat(rs->dir_fd, filename, O_RDONLY);
 #endif
 	if (fd < 0)
-		err(errno, "Can't open file %s", full_fn);
+		err(errno, "Can't open file %s/%s", rs->path, filename);
 
 	/* If the kernel follows our advice, f3read won't ever read from cache
 	 * even when testing small memory cards without a remount, and
@@ -251,25 +1260,67 @@ static void validate_file(struct flow *fw, struct dynamic_buffer *dbuf,
 		/* The issue https://github.com/AltraMayor/f3/issues/211
 		 * motivated the warning below.
 		 */
+		lock_output(rs);
 		printf("\nWARNING:\nThe operating system returned errno=%i for fdatasync(): %s\nThis error is unexpected and you may find more information on the log of the kernel (e.g. command dmesg(1) on Linux).\n\n",
 			saved_errno, strerror(saved_errno));
 		exit(saved_errno);
 	}
-	assert(!posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED));
 
-	/* Help the kernel to help us. */
-	assert(!posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL));
+	if (rd->direct) {
+		int rc = set_direct_io(fd);
+		if (rc) {
+			lock_output(rs);
+			printf("\nWARNING: Can't bypass the page cache: %s\nF3 Read will use the page cache from now on.\n\n",
+				strerror(rc));
+			unlock_output(rs);
+			rd->direct = false;
+		}
+	}
+
+	/* Reads that bypass the page cache need no advice. */
+	if (!rd->direct) {
+		assert(!posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED));
 
+		/* Help the kernel to help us. */
+		assert(!posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL));
+	}
+
+	/* Start the verifiers. */
+	assert(job->n_verifiers <= MAX_VERIFIERS);
+	pl_start(rd->pl, PL_ITEMS_UNKNOWN);
+	start_lost_runs(&job->runs);
+	for (i = 0; i < job->n_verifiers; i++) {
+		verifiers[i].pl = rd->pl;
+		verifiers[i].runs = &job->runs;
+		memset(&verifiers[i].stats, 0, sizeof(verifiers[i].stats));
+		verifiers[i].first_lost = UINT64_MAX;
+		verifiers[i].end_lost = 0;
+		verifiers[i].streaming = is_larger_than_cache(
+			pl_get_size(rd->pl));
+		saved_errno = pthread_create(&verifiers[i].thread, NULL,
+			verify_file, &verifiers[i]);
+		if (saved_errno)
+			errx(1, "Can't create thread: %s",
+				strerror(saved_errno));
+	}
+
+	if (fstat(fd, &st))
+		err(errno, "Can't stat file %s/%s", rs->path, filename);
+	start_reader(rd, fd, start_pos, st.st_size);
 	saved_errno = 0;
-	expected_offset = number << GIGABYTE_ORDER;
+	expected_offset = file_offset + start_pos;
+	assert(!pthread_mutex_lock(&rs->lock));
+	sampling = rs->sampling;
+	assert(!pthread_mutex_unlock(&rs->lock));
 	assert(!clock_gettime(CLOCK_MONOTONIC, &file_t1));
 	start_measurement(fw);
-	while (true) {
+	while (!sampling) {
 		size_t bytes_read;
 		struct fw_measurement m;
-		int rc = check_chunk(fw, dbuf, fd, &expected_offset, stats,
-			&bytes_read);
-		if (rc == 0 && bytes_read == 0) {
+		int rc = check_chunk(fw, rd, &job->runs, &expected_offset,
+			stats, &bytes_read);
+		/* A bail-out may end a chunk before its first read. */
+		if (rc == 0 && bytes_read == 0 && !must_bail_out(&job->runs)) {
 			stats->read_all = true;
 			break;
 		}
@@ -278,14 +1329,34 @@ static void validate_file(struct flow *fw, struct dynamic_buffer *dbuf,
 		if (m.valid) {
 			double inst_speed = calc_avg_speed(block_order,
 				m.blocks, m.time_ns);
-			file_speed_samples++;
-			if (inst_speed > file_max_speed)
-				file_max_speed = inst_speed;
-			if (inst_speed < file_min_speed)
-				file_min_speed = inst_speed;
-			file_tot_blocks += m.blocks;
-			file_tot_time_ns += m.time_ns;
+			res->file_speed_samples++;
+			if (inst_speed > res->file_max_speed)
+				res->file_max_speed = inst_speed;
+			if (inst_speed < res->file_min_speed)
+				res->file_min_speed = inst_speed;
+			res->file_tot_blocks += m.blocks;
+			res->file_tot_time_ns += m.time_ns;
 		}
+
+		assert(!pthread_mutex_lock(&rs->lock));
+		rs->read_blocks += bytes_read >> block_order;
+		/* Once a job bails out, all jobs sample. */
+		if (!rs->sampling && must_bail_out(&job->runs)) {
+			rs->sampling = true;
+			for (i = 0; i < rs->n_jobs; i++)
+				set_bail_out(&rs->jobs[i].runs);
+		}
+		sampling = rs->sampling;
+		assert(!pthread_mutex_unlock(&rs->lock));
+
+		if (rc == 0 && rs->journal) {
+			struct timespec now;
+			assert(!clock_gettime(CLOCK_MONOTONIC, &now));
+			if (diff_timespec_ns(&job->last_checkpoint, &now) >=
+					CHECKPOINT_INTERVAL_NS)
+				checkpoint(job, verifiers, stats);
+		}
+
 		if (rc != 0) {
 			saved_errno = rc;
 			break;
@@ -294,45 +1365,133 @@ static void validate_file(struct flow *fw, struct dynamic_buffer *dbuf,
 	end_measurement(fw);
 	assert(!clock_gettime(CLOCK_MONOTONIC, &file_t2));
 
-	print_status(stats);
-	if (!stats->read_all) {
-		assert(saved_errno != 0);
-		printf(" - NOT fully read due to \"%s\"",
-			strerror(saved_errno));
-	} else if (saved_errno != 0) {
-		printf(" - %s", strerror(saved_errno));
-	} else if (stats->bytes_read > 0) {
-		uint64_t file_time_ns = diff_timespec_ns(&file_t1, &file_t2);
-		double file_avg_speed;
+	/* Wait for the verifiers to finish the file, and merge their stats. */
+	pl_close(rd->pl);
+	for (i = 0; i < job->n_verifiers; i++) {
+		assert(!pthread_join(verifiers[i].thread, NULL));
+		stats->secs.ok += verifiers[i].stats.ok;
+		stats->secs.bad += verifiers[i].stats.bad;
+		stats->secs.changed += verifiers[i].stats.changed;
+		stats->secs.overwritten += verifiers[i].stats.overwritten;
+		if (verifiers[i].first_lost < first_lost)
+			first_lost = verifiers[i].first_lost;
+		if (verifiers[i].end_lost > end_lost)
+			end_lost = verifiers[i].end_lost;
+	}
 
-		if (file_speed_samples >= 2) {
-			file_avg_speed = calc_avg_speed(block_order,
-				file_tot_blocks, file_tot_time_ns);
-			print_avg_min_max_samples(" ", "",
-				file_avg_speed, file_min_speed,	file_max_speed,
-				file_speed_samples);
-		} else if (file_time_ns > 0) {
-			const uint64_t blocks_read =
-				stats->bytes_read >> block_order;
-			assert((stats->bytes_read & (block_size - 1)) == 0);
-			if (file_tot_blocks == blocks_read &&
-					file_tot_time_ns > 0) {
-				file_time_ns = file_tot_time_ns;
-			}
-			file_avg_speed = calc_avg_speed(block_order,
-				blocks_read, file_time_ns);
-			const char *unit = adjust_unit(&file_avg_speed);
-			printf(" Avg: %.2f %s/s", file_avg_speed, unit);
+	/* The reads stopped at rd->pos. */
+	if (sampling && !stats->read_all && saved_errno == 0) {
+		const uint64_t lost = lost_sectors(&stats->secs);
+		saved_errno = sample_file(job, fd, rd->pos,
+			file_offset + rd->pos, stats);
+		stats->read_all = saved_errno == 0;
+		/* Lost samples may be anywhere in the sampled part. */
+		if (lost_sectors(&stats->secs) > lost) {
+			if (file_offset + rd->pos < first_lost)
+				first_lost = file_offset + rd->pos;
+			end_lost = file_offset + stats->bytes_read;
 		}
 	}
-	printf("\n");
+	res->saved_errno = saved_errno;
+	res->file_time_ns = diff_timespec_ns(&file_t1, &file_t2);
+
+	if (rs->fix && first_lost < end_lost) {
+		res->lost_at_errno = get_physical_offset(fd,
+			first_lost - file_offset, end_lost - first_lost,
+			&res->lost_at);
+	}
 
 	close(fd);
-	free(full_fn);
 }
 
-static uint64_t get_total_blocks(const char *path, const uint64_t *files,
-	unsigned int block_order)
+/* Return the partial file of the resumed run whose number is @number,
+ * or NULL.
+ */
+static const struct partial_file *find_partial(const struct read_state *rs,
+	uint64_t number)
+{
+	unsigned int i;
+
+	for (i = 0; i < rs->n_partials; i++) {
+		if (rs->partials[i].number == number)
+			return &rs->partials[i];
+	}
+	return NULL;
+}
+
+static void *validate_files(void *arg)
+{
+	struct job *job = arg;
+	struct read_state *rs = job->rs;
+
+	do {
+		const struct partial_file *pf;
+		uint64_t index;
+
+		assert(!pthread_mutex_lock(&rs->lock));
+		if (rs->next_file >= rs->n_files) {
+			rs->n_running--;
+			assert(!pthread_cond_broadcast(&rs->cond));
+			assert(!pthread_mutex_unlock(&rs->lock));
+			break;
+		}
+		index = file_index(rs, rs->next_file++);
+		pf = find_partial(rs, rs->files[index]);
+		if (pf) {
+			job->file = *pf;
+		} else {
+			memset(&job->file, 0, sizeof(job->file));
+			job->file.number = rs->files[index];
+		}
+		job->busy = true;
+		assert(!pthread_mutex_unlock(&rs->lock));
+
+		assert(!clock_gettime(CLOCK_MONOTONIC, &job->last_checkpoint));
+		validate_file(job, &rs->results[index]);
+
+		lock_output(rs);
+		job->busy = false;
+		rs->results[index].done = true;
+		report_files(rs);
+		save_journal(rs);
+		unlock_output(rs);
+	} while (true);
+	return NULL;
+}
+
+/* Wait for the jobs, and account their aggregated progress once a second. */
+static void wait_jobs(struct read_state *rs)
+{
+	struct timespec last, now, deadline;
+	uint64_t last_blocks = 0;
+
+	assert(!clock_gettime(CLOCK_MONOTONIC, &last));
+	assert(!pthread_mutex_lock(&rs->lock));
+	do {
+		int rc;
+
+		/* Condition variables wait on the realtime clock. */
+		assert(!clock_gettime(CLOCK_REALTIME, &deadline));
+		deadline.tv_sec++;
+		rc = pthread_cond_timedwait(&rs->cond, &rs->lock, &deadline);
+		assert(rc == 0 || rc == ETIMEDOUT);
+
+		assert(!clock_gettime(CLOCK_MONOTONIC, &now));
+		if (rs->n_running == 0 ||
+				diff_timespec_ns(&last, &now) >= 1000000000ULL) {
+			add_measurement(&rs->agg_fw,
+				rs->read_blocks - last_blocks,
+				diff_timespec_ns(&last, &now));
+			last_blocks = rs->read_blocks;
+			last = now;
+		}
+	} while (rs->n_running > 0);
+	clear_progress(&rs->agg_fw);
+	assert(!pthread_mutex_unlock(&rs->lock));
+}
+
+static uint64_t get_total_blocks(const char *path, int dir_fd,
+	const uint64_t *files, unsigned int block_order)
 {
 	const unsigned int block_size = 1U << block_order;
 	uint64_t total_blocks = 0;
@@ -340,87 +1499,307 @@ static uint64_t get_total_blocks(const char *path, const uint64_t *files,
 	while (*files != (uint64_t)-1) {
 		struct stat st;
 		int ret;
-		const char *filename;
-		char *full_fn = full_fn_from_number(&filename, path, *files);
-		assert(full_fn);
+		char filename[MY_FILENAME_SIZE];
 
-		ret = stat(full_fn, &st);
+		filename_from_number(filename, *files);
+		ret = fstatat(dir_fd, filename, &st, 0);
 		if (ret < 0)
-			err(errno, "Can't stat file %s", full_fn);
+			err(errno, "Can't stat file %s/%s", path, filename);
 		if ((st.st_mode & S_IFMT) != S_IFREG)
-			err(EINVAL, "File %s is not a regular file", full_fn);
+			err(EINVAL, "File %s/%s is not a regular file",
+				path, filename);
 
 		assert((st.st_size & (block_size - 1)) == 0);
 		total_blocks += st.st_size >> block_order;
 
-		free(full_fn);
 		files++;
 	}
 	return total_blocks;
 }
 
-static void iterate_files(const char *path, const uint64_t *files,
-	uint64_t start_at, uint64_t end_at, uint64_t max_read_rate,
-	int progress)
+struct file_location {
+	uint64_t	offset;
+	uint64_t	index;
+};
+
+static int location_cmp(const void *pa, const void *pb)
+{
+	const struct file_location *a = pa;
+	const struct file_location *b = pb;
+
+	if (a->offset != b->offset)
+		return a->offset < b->offset ? -1 : 1;
+	return a->index < b->index ? -1 : a->index > b->index;
+}
+
+/* Return the indexes of the @n_files files of @files sorted by
+ * the locations of their first extents on the drive, or NULL if
+ * the file system can't tell the location of a file.
+ * Caller must free(3) the returned pointer.
+ */
+static uint64_t *get_physical_schedule(const char *path, int dir_fd,
+	const uint64_t *files, uint64_t n_files)
+{
+	struct file_location *locs;
+	uint64_t *schedule;
+	uint64_t i;
+
+	if (n_files == 0)
+		return NULL;
+	locs = malloc(n_files * sizeof(*locs));
+	schedule = malloc(n_files * sizeof(*schedule));
+	if (!locs || !schedule)
+		errx(1, "Can't allocate the locations of the files");
+	for (i = 0; i < n_files; i++) {
+		char filename[MY_FILENAME_SIZE];
+		int fd, rc;
+
+		filename_from_number(filename, files[i]);
+		fd = openat(dir_fd, filename, O_RDONLY);
+		if (fd < 0)
+			err(errno, "Can't open file %s/%s", path, filename);
+		rc = get_physical_offset(fd, 0, 1, &locs[i].offset);
+		close(fd);
+		if (rc) {
+			printf("WARNING: Can't locate file %s/%s on the drive: %s\nF3 Read will validate the files in numeric order.\n\n",
+				path, filename, strerror(rc));
+			free(locs);
+			free(schedule);
+			return NULL;
+		}
+		locs[i].index = i;
+	}
+	qsort(locs, n_files, sizeof(*locs), location_cmp);
+
+	for (i = 0; i < n_files; i++)
+		schedule[i] = locs[i].index;
+	free(locs);
+	return schedule;
+}
+
+/* The good region of the disk ends before the first lost sector;
+ * see print_fix_cmd() of f3brew.
+ */
+static void print_fix_cmd(const struct read_state *rs)
+{
+	const struct fix_location *fix = rs->fix;
+	const uint64_t first_1MB_sector = MEGABYTE_SIZE >> SECTOR_ORDER;
+	uint64_t first_lost_sector;
+	int rc = fix->rc ? fix->rc : rs->lost_at_errno;
+
+	if (rc) {
+		printf("Can't locate the lost sectors on the disk: %s\n\n",
+			strerror(rc));
+		return;
+	}
+	if (rs->lost_at == UINT64_MAX) {
+		printf("No sector was lost, so there is nothing to \"fix\".\n\n");
+		return;
+	}
+
+	first_lost_sector = fix->start_sector +
+		(rs->lost_at >> SECTOR_ORDER);
+	printf("The first lost sector is sector %" PRIu64 " of %s\n",
+		first_lost_sector, fix->disk);
+	if (first_lost_sector < 2 * first_1MB_sector) {
+		printf("There is no good region large enough to \"fix\" this device.\n\n");
+		return;
+	}
+	printf("You can \"fix\" this device using the following command:\n");
+	printf("f3fix --last-sec=%" PRIu64 " %s\n\n",
+		first_lost_sector - 1, fix->disk);
+}
+
+/* If @rj is not NULL, resume the run it records;
+ * @files then only has the files not yet reported.
+ * If @fix is not NULL, show how to call f3fix.
+ */
+static void iterate_files(const char *path, int dir_fd, const uint64_t *files,
+	uint64_t start_at, uint64_t end_at, struct pacer *pacer,
+	unsigned int queue_depth, bool direct, unsigned int n_jobs,
+	unsigned int file_order, bool physical_order, uint64_t bail_out,
+	const struct fix_location *fix, struct journal *journal,
+	const struct read_journal *rj, int progress)
 {
 	const unsigned int block_order = get_block_order(path);
-	struct block_stats tot_stats = {0, 0, 0, 0};
-	uint64_t tot_size = 0;
-	int and_read_all = 1;
-	int or_missing_file = 0;
-	uint64_t number = start_at;
-	struct flow fw;
-	struct dynamic_buffer dbuf;
-
-	UNUSED(end_at);
-
-	init_flow(&fw, block_order, get_total_blocks(path, files, block_order),
-		max_read_rate, (GIGABYTE_SIZE >> block_order),
+	uint64_t total_blocks = get_total_blocks(path, dir_fd, files,
+		block_order);
+	unsigned int n_verifiers;
+	struct read_state rs;
+	struct job *jobs;
+	uint64_t n_files;
+	unsigned int i;
+	int rc;
+
+	if (rj) {
+		/* Blocks of the previous run count toward the progress. */
+		total_blocks += rj->blocks;
+		for (i = 0; i < rj->n_partials; i++)
+			total_blocks -= rj->partials[i].pos >> block_order;
+	}
+
+	for (n_files = 0; files[n_files] != (uint64_t)-1; n_files++)
+		;
+	/* There is no point in having more jobs than files. */
+	if (n_files > 0 && n_jobs > n_files)
+		n_jobs = n_files;
+	n_verifiers = pl_get_n_workers(MAX_VERIFIERS) / n_jobs;
+	if (n_verifiers < 1)
+		n_verifiers = 1;
+
+	assert(!pthread_mutex_init(&rs.lock, NULL));
+	assert(!pthread_cond_init(&rs.cond, NULL));
+	rs.path = path;
+	rs.dir_fd = dir_fd;
+	rs.files = files;
+	rs.n_files = n_files;
+	rs.schedule = physical_order
+		? get_physical_schedule(path, dir_fd, files, n_files) : NULL;
+	rs.n_jobs = n_jobs;
+	rs.file_order = file_order;
+	rs.next_file = 0;
+	rs.next_report = 0;
+	rs.n_running = n_jobs;
+	rs.results = calloc(n_files + 1, sizeof(*rs.results));
+	if (!rs.results)
+		errx(1, "Can't allocate the results");
+	rs.read_blocks = 0;
+	init_flow(&rs.agg_fw, block_order, total_blocks,
+		FW_MAX_PROCESS_RATE_NONE, FW_MAX_BLOCKS_PER_DELAY_NONE,
 		progress ? printf_flush_cb : dummy_cb, 0);
-	dbuf_init(&dbuf);
+	memset(&rs.tot_stats, 0, sizeof(rs.tot_stats));
+	rs.tot_size = 0;
+	rs.and_read_all = 1;
+	rs.or_missing_file = 0;
+	rs.tot_sampled = 0;
+	rs.number = start_at;
+	rs.reported_number = start_at;
+	rs.journal = journal;
+	rs.start_at = start_at;
+	rs.end_at = end_at;
+	rs.partials = NULL;
+	rs.n_partials = 0;
+	rs.sampling = false;
+	rs.fix = fix;
+	rs.lost_at = UINT64_MAX;
+	rs.lost_at_errno = 0;
+	if (rj) {
+		rs.tot_stats = rj->tot_stats;
+		rs.tot_size = rj->tot_size;
+		rs.and_read_all = rj->and_read_all;
+		rs.or_missing_file = rj->or_missing_file;
+		rs.tot_sampled = rj->tot_sampled;
+		rs.sampling = rj->sampling;
+		rs.lost_at = rj->lost_at;
+		if (lost_sectors(&rj->tot_stats) > 0)
+			rs.lost_at_errno = rj->lost_at_errno;
+		rs.number = rj->number;
+		rs.reported_number = rj->number;
+		rs.partials = rj->partials;
+		rs.n_partials = rj->n_partials;
+	}
+
+	jobs = calloc(n_jobs, sizeof(*jobs));
+	if (!jobs)
+		errx(1, "Can't allocate the jobs");
+	rs.jobs = jobs;
+	for (i = 0; i < n_jobs; i++) {
+		struct job *job = &jobs[i];
+
+		job->rs = &rs;
+		job->n_verifiers = n_verifiers;
+		/* The readers pace the reads, so the flows do not
+		 * limit the rate.
+		 */
+		if (n_jobs == 1) {
+			init_flow(&job->fw, block_order, total_blocks,
+				FW_MAX_PROCESS_RATE_NONE,
+				(1ULL << (file_order - block_order)),
+				progress ? printf_flush_cb : dummy_cb, 0);
+		} else {
+			/* The progress is aggregated by wait_jobs(). */
+			init_flow(&job->fw, block_order, total_blocks,
+				FW_MAX_PROCESS_RATE_NONE,
+				(1ULL << (file_order - block_order)), dummy_cb, 0);
+		}
+		/* Two slots per verifier let verifiers work while
+		 * the reads in flight hold slots.
+		 */
+		rc = pl_init(&job->pl, 2 * n_verifiers + queue_depth,
+			SLOT_SIZE, block_order);
+		if (rc)
+			errx(1, "Can't allocate buffers: %s", strerror(rc));
+		init_reader(&job->rd, &job->pl, queue_depth, direct, pacer);
+		init_lost_runs(&job->runs, bail_out, job->pl.n_slots);
+	}
+	if (rj) {
+		fw_resume_measurements(n_jobs == 1 ? &jobs[0].fw : &rs.agg_fw,
+			rj->blocks, rj->time_ns);
+	}
+
+	if (bail_out)
+		srand(time(NULL));
+
+	/* Record the start of a new run right away, so a stale journal
+	 * never describes this run.
+	 */
+	save_journal(&rs);
 
 	printf("                  SECTORS      ok/corrupted/changed/overwritten\n");
-	while (*files != (uint64_t)-1) {
-		struct file_stats stats;
-
-		or_missing_file = or_missing_file || (*files != number);
-		for (; number < *files; number++) {
-			const char *filename;
-			char *full_fn = full_fn_from_number(&filename, "",
-				number);
-			assert(full_fn);
-			printf("Missing file %s\n", filename);
-			free(full_fn);
+	if (n_jobs == 1) {
+		validate_files(&jobs[0]);
+	} else {
+		for (i = 0; i < n_jobs; i++) {
+			rc = pthread_create(&jobs[i].thread, NULL,
+				validate_files, &jobs[i]);
+			if (rc)
+				errx(1, "Can't create thread: %s",
+					strerror(rc));
 		}
-		number++;
-
-		validate_file(&fw, &dbuf, path, *files, &stats);
-		tot_stats.ok += stats.secs.ok;
-		tot_stats.bad += stats.secs.bad;
-		tot_stats.changed += stats.secs.changed;
-		tot_stats.overwritten += stats.secs.overwritten;
-		tot_size += stats.bytes_read;
-		and_read_all = and_read_all && stats.read_all;
-		files++;
+		wait_jobs(&rs);
+		for (i = 0; i < n_jobs; i++)
+			assert(!pthread_join(jobs[i].thread, NULL));
 	}
-	assert((tot_stats.ok + tot_stats.bad + tot_stats.changed +
-		tot_stats.overwritten) << SECTOR_ORDER == tot_size);
+	assert(rs.next_report == n_files);
+	assert((rs.tot_stats.ok + rs.tot_stats.bad + rs.tot_stats.changed +
+		rs.tot_stats.overwritten) << SECTOR_ORDER == rs.tot_size);
 
 	/* Notice that not reporting `missing' files after the last file
 	 * in @files is important since @end_at could be very large.
 	 */
 
-	print_stats(&tot_stats, SECTOR_ORDER, "sector");
-	if (or_missing_file)
+	print_stats(&rs.tot_stats, SECTOR_ORDER, "sector");
+	if (rs.or_missing_file)
 		printf("WARNING: Not all F3 files in the range %" PRIu64 " to %" PRIu64 " are available\n",
-			start_at + 1, number);
-	if (!and_read_all)
+			start_at + 1, rs.number);
+	if (!rs.and_read_all)
 		printf("WARNING: Not all data was read due to I/O error(s)\n");
+	if (rs.tot_sampled > 0) {
+		double f = (double)rs.tot_sampled;
+		const char *unit = adjust_unit(&f);
+		printf("WARNING: After a long run of lost sectors, %.2f %s were sampled instead of read, so the counts above are partly EXTRAPOLATED\n",
+			f, unit);
+	}
 
 	/* Reading speed. */
-	print_avg_seq_speed(&fw, "read", true);
+	print_avg_seq_speed(n_jobs == 1 ? &jobs[0].fw : &rs.agg_fw, "read",
+		true);
+
+	if (fix) {
+		printf("\n");
+		print_fix_cmd(&rs);
+	}
 
-	dbuf_free(&dbuf);
+	for (i = 0; i < n_jobs; i++) {
+		free_reader(&jobs[i].rd);
+		free_lost_runs(&jobs[i].runs);
+		pl_free(&jobs[i].pl);
+	}
+	free(jobs);
+	free((void *)rs.schedule);
+	free(rs.results);
+	pthread_cond_destroy(&rs.cond);
+	pthread_mutex_destroy(&rs.lock);
 }
 
 int main(int argc, char **argv)
@@ -432,20 +1811,77 @@ int main(int argc, char **argv)
 		.start_at	= 0,
 		.end_at		= LONG_MAX - 1,
 		.max_read_rate	= FW_MAX_PROCESS_RATE_NONE,
+		.max_read_iops	= PC_MAX_IOPS_NONE,
+		.burst_ms	= 100,
+		.queue_depth	= 4,
+		.direct		= false,
+		.n_jobs		= 1,
+		/* Derive the size of the files from the files. */
+		.file_order	= 0,
+		.physical_order	= false,
+		.fix_cmd	= false,
+		.bail_out	= 0,
+		.journal_filename = NULL,
+		.resume		= false,
 		/* If stdout isn't a terminal, suppress progress. */
 		.show_progress	= isatty(STDOUT_FILENO),
 	};
+	struct journal journal;
+	struct read_journal rj;
+	struct fix_location fix;
+	struct pacer pacer;
+	bool resumed = false;
+	int dir_fd, rc;
 
 	/* Read parameters. */
 	argp_parse(&argp, argc, argv, 0, NULL, &args);
 	print_header(stdout, "read");
 
+	/* The journal is on the host, so open it before
+	 * adjust_dev_path() changes the root directory.
+	 */
+	if (args.journal_filename) {
+		rc = journal_init(&journal, args.journal_filename);
+		if (rc)
+			errx(1, "Can't open the journal `%s': %s",
+				args.journal_filename, strerror(rc));
+		if (args.resume)
+			resumed = load_journal(&journal, &rj);
+	}
+
+	/* The disk is found through the file system of the host. */
+	if (args.fix_cmd) {
+		fix.rc = locate_file_system(args.dev_path, fix.disk,
+			sizeof(fix.disk), &fix.start_sector);
+	}
+
 	adjust_dev_path(&args.dev_path);
 
-	files = ls_my_files(args.dev_path, args.start_at, args.end_at);
+	if (resumed) {
+		printf("Resuming the run recorded in the journal\n");
+		args.start_at = rj.start_at;
+		args.end_at = rj.end_at;
+		args.file_order = rj.file_order;
+	}
+	/* The files already reported are not listed. */
+	dir_fd = open_dir(args.dev_path);
+	files = ls_my_files(dir_fd,
+		resumed ? rj.number : args.start_at, args.end_at);
+	if (!args.file_order)
+		args.file_order = get_file_order(dir_fd, files);
 
-	iterate_files(args.dev_path, files, args.start_at, args.end_at,
-		args.max_read_rate, args.show_progress);
+	init_pacer(&pacer, args.max_read_rate, args.max_read_iops,
+		args.burst_ms * 1000000ULL);
+	iterate_files(args.dev_path, dir_fd, files, args.start_at, args.end_at,
+		&pacer, args.queue_depth, args.direct,
+		args.n_jobs, args.file_order, args.physical_order, args.bail_out,
+		args.fix_cmd ? &fix : NULL,
+		args.journal_filename ? &journal : NULL,
+		resumed ? &rj : NULL, args.show_progress);
+	free_pacer(&pacer);
 	free((void *)files);
+	close(dir_fd);
+	if (args.journal_filename)
+		journal_free(&journal);
 	return 0;
 }
@@ -1,5 +1,5 @@
-#define _POSIX_C_SOURCE 200112L
-#define _XOPEN_SOURCE 600
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
 
 #include <assert.h>
 #include <stddef.h>
@@ -19,10 +19,14 @@
 #include <err.h>
 #include <argp.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "libutils.h"
 #include "libfile.h"
 #include "libflow.h"
+#include "libpipe.h"
+#include "libjournal.h"
 #include "version.h"
 
 /* Argp's global variables. */
@@ -34,6 +38,12 @@ static char adoc[] = "<PATH>";
 static char doc[] = "F3 Write -- fill a drive out with .h2w files "
 	"to test its real capacity";
 
+/* Maximum number of files written concurrently. */
+#define MAX_STREAMS	(16)
+
+/* Maximum number of blocks checked by --canary after each file. */
+#define MAX_CANARIES	(1024)
+
 static struct argp_option options[] = {
 	{"start-at",		's',	"NUM",		0,
 		"First NUM.h2w file to be written",			1},
@@ -41,6 +51,30 @@ static struct argp_option options[] = {
 		"Last NUM.h2w file to be written",			0},
 	{"max-write-rate",	'w',	"KB/s",		0,
 		"Maximum write rate",					0},
+	{"max-write-iops",	'i',	"NUM",		0,
+		"Maximum number of writes per second",			0},
+	{"burst",		'B',	"MS",		0,
+		"Let the writes run up to MS milliseconds ahead of the maximum rates",
+		0},
+	{"queue-depth",		'q',	"NUM",		0,
+		"Maximum number of writes in flight",			0},
+	{"direct",		'd',	NULL,		0,
+		"Bypass the page cache of the operating system",	0},
+	{"streams",		'n',	"NUM",		0,
+		"Number of files written concurrently",		0},
+	{"file-size",		'f',	"SIZE",		0,
+		"Size of the .h2w files; a power of 2 from 64M to 64G",
+		0},
+	{"verify-behind",	'v',	NULL,		0,
+		"Validate each file while the next ones are written",	0},
+	{"canary",		'c',	"NUM",		0,
+		"After each file, check NUM random blocks of the files written before, and stop if one was lost",
+		0},
+	{"journal",		'J',	"FILE",		0,
+		"Record the progress in FILE, which must not be on the drive",
+		0},
+	{"resume",		'R',	NULL,		0,
+		"Resume the run recorded in the journal, if any",	0},
 	{"show-progress",	'p',	"NUM",		0,
 		"Show progress if NUM is not zero",			0},
 	{ 0 }
@@ -50,6 +84,16 @@ struct args {
 	uint64_t	start_at;
 	uint64_t	end_at;
 	uint64_t	max_write_rate;
+	uint64_t	max_write_iops;
+	uint64_t	burst_ms;
+	unsigned int	queue_depth;
+	bool		direct;
+	unsigned int	n_streams;
+	unsigned int	file_order;
+	bool		verify_behind;
+	unsigned int	n_canaries;
+	const char	*journal_filename;
+	bool		resume;
 	int		show_progress;
 	const char	*dev_path;
 };
@@ -84,6 +128,75 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		args->max_write_rate = ll;
 		break;
 
+	case 'i':
+		ll = arg_to_ll_bytes(state, arg);
+		if (ll <= 0)
+			argp_error(state,
+				"NUM must be greater than zero");
+		args->max_write_iops = ll;
+		break;
+
+	case 'B':
+		ll = arg_to_ll_bytes(state, arg);
+		if (ll < 0)
+			argp_error(state,
+				"MS must be greater or equal to zero");
+		args->burst_ms = ll;
+		break;
+
+	case 'q':
+		ll = arg_to_ll_bytes(state, arg);
+		if (ll <= 0 || ll > IO_MAX_QUEUE_DEPTH)
+			argp_error(state,
+				"NUM must be in the interval [1, %i]",
+				IO_MAX_QUEUE_DEPTH);
+		args->queue_depth = ll;
+		break;
+
+	case 'd':
+		args->direct = true;
+		break;
+
+	case 'n':
+		ll = arg_to_ll_bytes(state, arg);
+		if (ll <= 0 || ll > MAX_STREAMS)
+			argp_error(state,
+				"NUM must be in the interval [1, %i]",
+				MAX_STREAMS);
+		args->n_streams = ll;
+		break;
+
+	case 'f':
+		ll = arg_to_ll_bytes(state, arg);
+		if (ll <= 0 || !is_power_of_2(ll) ||
+				ilog2(ll) < MIN_FILE_ORDER ||
+				ilog2(ll) > MAX_FILE_ORDER)
+			argp_error(state,
+				"SIZE must be a power of 2 from 64M to 64G");
+		args->file_order = ilog2(ll);
+		break;
+
+	case 'v':
+		args->verify_behind = true;
+		break;
+
+	case 'c':
+		ll = arg_to_ll_bytes(state, arg);
+		if (ll < 0 || ll > MAX_CANARIES)
+			argp_error(state,
+				"NUM must be in the interval [0, %i]",
+				MAX_CANARIES);
+		args->n_canaries = ll;
+		break;
+
+	case 'J':
+		args->journal_filename = arg;
+		break;
+
+	case 'R':
+		args->resume = true;
+		break;
+
 	case 'p':
 		args->show_progress = !!arg_to_ll_bytes(state, arg);
 		break;
@@ -106,6 +219,9 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		if (args->start_at > args->end_at)
 			argp_error(state,
 				"Option --start-at must be less or equal to option --end-at");
+		if (args->resume && !args->journal_filename)
+			argp_error(state,
+				"Option --resume requires option --journal");
 		break;
 
 	default:
@@ -116,107 +232,848 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 
 static struct argp argp = {options, parse_opt, adoc, doc, NULL, NULL, NULL};
 
-static void fill_buffer(char *buf, uint64_t sectors, uint64_t *poffset)
+static void fill_buffer(char *buf, uint64_t sectors, uint64_t *poffset,
+	bool streaming)
 {
-	uint64_t i;
-	for (i = 0; i < sectors; i++) {
-		fill_buffer_with_block(buf, SECTOR_ORDER, *poffset, 0);
-		buf += SECTOR_SIZE;
-		*poffset += SECTOR_SIZE;
+	fill_buffer_with_blocks(buf, sectors, SECTOR_ORDER, *poffset, 0,
+		streaming);
+	*poffset += sectors << SECTOR_ORDER;
+}
+
+/* @buf was just filled by pread(2), so its data is in the cache. */
+static void check_buffer(char *buf, uint64_t sectors,
+	uint64_t *pexpected_offset, struct block_stats *stats)
+{
+	validate_blocks_update_stats(buf, sectors, SECTOR_ORDER,
+		*pexpected_offset, 0, stats, false);
+	*pexpected_offset += sectors << SECTOR_ORDER;
+}
+
+/* The data of a file is generated by threads into the slots of
+ * a pipeline while the main thread writes the slots already generated.
+ * This way, the drive does not wait for the generation of data, and
+ * the generation of data does not wait for the drive.
+ */
+
+#define MAX_GENERATORS	(4)
+#define SLOT_SIZE	(4 * MEGABYTE_SIZE)
+
+struct generator {
+	struct pipeline	*pl;
+	/* Offset of the first byte of the file. */
+	uint64_t	offset;
+	/* Size of the file in bytes. */
+	uint64_t	size;
+	/* The slots are written long after they are filled, so
+	 * the stores bypass the cache when the slots do not fit in it.
+	 */
+	bool		streaming;
+};
+
+static void *generate_file(void *arg)
+{
+	const struct generator *gen = arg;
+	const size_t slot_size = pl_get_slot_size(gen->pl);
+	struct pl_slot *slot;
+
+	while ((slot = pl_get_free(gen->pl)) != NULL) {
+		const uint64_t pos = slot->seq * slot_size;
+		uint64_t offset = gen->offset + pos;
+
+		slot->len = MIN(slot_size, gen->size - pos);
+		assert((slot->len & (SECTOR_SIZE - 1)) == 0);
+		fill_buffer(slot->buf, slot->len >> SECTOR_ORDER, &offset,
+			gen->streaming);
+		pl_put_full(gen->pl, slot);
 	}
+	return NULL;
 }
 
-static int write_all(int fd, const char *buf, size_t *pbytes)
+/* The main thread keeps up to queue_depth writes in flight. */
+struct writer {
+	struct pipeline		*pl;
+	struct io_engine	*eng;
+	int			fd;
+	/* Bypass the page cache. */
+	bool			direct;
+	/* Shared by all writers. */
+	struct pacer		*pacer;
+	/* Position in the file of the next write. */
+	uint64_t		pos;
+
+	/* Slot being submitted, and how much of it has been submitted. */
+	struct pl_slot		*slot;
+	size_t			slot_pos;
+	/* Number of writes in flight of each slot. */
+	unsigned int		*slot_reqs;
+
+	/* Requests not in flight. */
+	struct io_req		*reqs;
+	struct io_req		**free_reqs;
+	unsigned int		n_free_reqs;
+};
+
+static void init_writer(struct writer *wr, struct pipeline *pl,
+	unsigned int queue_depth, bool direct, struct pacer *pacer)
 {
-	ssize_t rc;
-	size_t done = 0;
-	do {
-		rc = write(fd, buf + done, *pbytes - done);
-		if (rc < 0) {
-			rc = errno;
-			goto out;
-		}
-		done += rc;
-	} while (done < *pbytes);
-	rc = 0;
+	char *bufs[pl->n_slots];
+	unsigned int i;
+
+	for (i = 0; i < pl->n_slots; i++)
+		bufs[i] = pl->slots[i].buf;
+	wr->eng = create_io_engine(queue_depth, bufs, pl->n_slots,
+		pl_get_slot_size(pl));
+	if (!wr->eng)
+		errx(1, "Can't create the I/O engine");
+
+	wr->pl = pl;
+	wr->direct = direct;
+	wr->pacer = pacer;
+	wr->slot_reqs = calloc(pl->n_slots, sizeof(*wr->slot_reqs));
+	wr->reqs = calloc(queue_depth, sizeof(*wr->reqs));
+	wr->free_reqs = calloc(queue_depth, sizeof(*wr->free_reqs));
+	if (!wr->slot_reqs || !wr->reqs || !wr->free_reqs)
+		errx(1, "Can't allocate the writer");
+	for (i = 0; i < queue_depth; i++)
+		wr->free_reqs[i] = &wr->reqs[i];
+	wr->n_free_reqs = queue_depth;
+}
+
+static void free_writer(struct writer *wr)
+{
+	free_io_engine(wr->eng);
+	free(wr->free_reqs);
+	free(wr->reqs);
+	free(wr->slot_reqs);
+}
+
+static void start_writer(struct writer *wr, int fd, uint64_t pos)
+{
+	wr->fd = fd;
+	wr->pos = pos;
+	wr->slot = NULL;
+	wr->slot_pos = 0;
+	memset(wr->slot_reqs, 0, wr->pl->n_slots * sizeof(*wr->slot_reqs));
+}
+
+static inline struct io_req *get_req(struct writer *wr)
+{
+	assert(wr->n_free_reqs > 0);
+	return wr->free_reqs[--wr->n_free_reqs];
+}
+
+static inline void put_req(struct writer *wr, struct io_req *req)
+{
+	wr->free_reqs[wr->n_free_reqs++] = req;
+}
+
+/* Return true if taking the next full slot cannot wait for a write in
+ * flight. Writes finish out of order, so the oldest slot still being
+ * written may be a whole ring behind.
+ */
+static bool can_submit_write(const struct writer *wr)
+{
+	uint64_t next_seq;
+	unsigned int i;
+
+	if (io_is_full(wr->eng))
+		return false;
+	if (wr->slot)
+		return true;
+
+	next_seq = pl_next_consume_seq(wr->pl);
+	for (i = 0; i < wr->pl->n_slots; i++) {
+		if (wr->slot_reqs[i] > 0 &&
+			next_seq - wr->pl->slots[i].seq >= wr->pl->n_slots)
+			return false;
+	}
+	return true;
+}
+
+/* Submit the next write of the chunk. */
+static int submit_write(struct writer *wr, uint64_t *pchunk_size)
+{
+	struct io_req *req = get_req(wr);
+	unsigned int index;
+	int rc;
 
-out:
-	*pbytes = done;
+	if (!wr->slot) {
+		wr->slot = pl_get_full(wr->pl);
+		assert(wr->slot);
+		wr->slot_pos = 0;
+	}
+	index = pl_slot_index(wr->pl, wr->slot);
+
+	req->op = IO_OP_WRITE;
+	req->fd = wr->fd;
+	req->buf = wr->slot->buf + wr->slot_pos;
+	req->len = MIN(*pchunk_size, wr->slot->len - wr->slot_pos);
+	req->offset = wr->pos;
+	req->buf_index = index;
+	req->data = wr->slot;
+	pace(wr->pacer, req->len);
+	rc = io_submit(wr->eng, req);
+	if (rc) {
+		put_req(wr, req);
+		return rc;
+	}
+	wr->slot_reqs[index]++;
+
+	wr->pos += req->len;
+	*pchunk_size -= req->len;
+	wr->slot_pos += req->len;
+	if (wr->slot_pos == wr->slot->len)
+		wr->slot = NULL;
+	return 0;
+}
+
+static int submit_fdatasync(struct writer *wr)
+{
+	struct io_req *req = get_req(wr);
+	int rc;
+
+	req->op = IO_OP_FDATASYNC;
+	req->fd = wr->fd;
+	req->data = NULL;
+	rc = io_submit(wr->eng, req);
+	if (rc)
+		put_req(wr, req);
 	return rc;
 }
 
-static int write_chunk(struct flow *fw, struct dynamic_buffer *dbuf,
-	int fd, uint64_t remaining_blocks, uint64_t *poffset,
-	size_t *ptot_bytes_written)
+/* Write a chunk, and push it to the drive.
+ * Return the first error found.
+ *
+ * The writeback of each write starts as soon as the write finishes,
+ * and only the range of the chunk is waited for at the end of the chunk.
+ * Only the last chunk of a file, or a failure, calls for a barrier
+ * (i.e. fdatasync(2)), which also flushes the cache of the drive.
+ * This way, the queue of the drive is not drained after every chunk,
+ * and libflow still measures data that has reached the drive.
+ */
+static int write_chunk(struct flow *fw, struct writer *wr,
+	uint64_t remaining_blocks, size_t *ptot_bytes_written)
 {
-	int rc = 0;
-	uint64_t chunk_size = MIN(get_rem_chunk_blocks(fw), remaining_blocks)
-		<< fw_get_block_order(fw);
-	size_t len = chunk_size;
-	char * const buf = dbuf_get_buf(dbuf, 0, &len);
+	const uint64_t chunk_blocks =
+		MIN(get_rem_chunk_blocks(fw), remaining_blocks);
+	const bool last_chunk = chunk_blocks == remaining_blocks;
+	const uint64_t chunk_offset = wr->pos;
+	uint64_t chunk_size = chunk_blocks << fw_get_block_order(fw);
 	size_t tot_bytes_written = 0;
+	bool synced = false;
+	struct io_req *req;
+	int rc = 0;
 
-	while (chunk_size > 0) {
-		const size_t turn_size = MIN(chunk_size, len);
-		size_t bytes_written = turn_size;
+	do {
+		/* Keep the queue full. */
+		while (!rc && chunk_size > 0 && can_submit_write(wr))
+			rc = submit_write(wr, &chunk_size);
 
-		assert((turn_size & (SECTOR_SIZE - 1)) == 0);
-		fill_buffer(buf, turn_size >> SECTOR_ORDER, poffset);
+		/* Add a barrier once all writes are submitted. */
+		if (!synced && (rc || (last_chunk && chunk_size == 0)) &&
+				!io_is_full(wr->eng)) {
+			int rc2 = submit_fdatasync(wr);
+			if (!rc)
+				rc = rc2;
+			synced = true;
+		}
 
-		rc = write_all(fd, buf, &bytes_written);
-		tot_bytes_written += bytes_written;
-		if (rc != 0)
-			goto out;
-		assert(bytes_written == turn_size);
-		chunk_size -= turn_size;
-	}
+		req = io_wait(wr->eng);
+		if (!req)
+			break;
+
+		if (req->op == IO_OP_WRITE) {
+			struct pl_slot *slot = req->data;
+			const unsigned int index = pl_slot_index(wr->pl, slot);
+
+			tot_bytes_written += req->res;
+			if (!req->err && req->res < req->len)
+				req->err = EIO;
+			if (!wr->direct && req->res > 0)
+				start_writeback(wr->fd, req->offset, req->res);
+
+			assert(wr->slot_reqs[index] > 0);
+			wr->slot_reqs[index]--;
+			if (!wr->slot_reqs[index] && slot != wr->slot)
+				pl_put_free(wr->pl, slot);
+		}
+		/* Preserve the first error. */
+		if (!rc)
+			rc = req->err;
+		put_req(wr, req);
+	} while (true);
+
+	/* Direct writes have already reached the drive. */
+	if (!rc && !synced && !wr->direct)
+		rc = wait_writeback(wr->fd, chunk_offset, tot_bytes_written);
 
-out:
 	*ptot_bytes_written = tot_bytes_written;
 	return rc;
 }
 
-/* Return true when disk is full. */
-static int create_and_fill_file(struct flow *fw, struct dynamic_buffer *dbuf,
-	const char *path, uint64_t number, int *phas_suggested_max_write_rate)
+/* Several streams write files concurrently; each stream has its own flow,
+ * pipeline, and writer, and takes the next file number when it finishes
+ * a file. This way, the numbering of the files does not change, and
+ * drives that need concurrent streams to reach their full speed get them.
+ */
+
+/* Seconds between checkpoints of a file in the journal. */
+#define CHECKPOINT_INTERVAL_NS	(5 * 1000000000ULL)
+
+/* A file that was being written when the journal was saved. */
+struct partial_file {
+	uint64_t	number;
+	/* Bytes of the file that reached the drive. */
+	uint64_t	pos;
+};
+
+/* The content of the journal of f3write. */
+struct write_journal {
+	unsigned int		file_order;
+	uint64_t		end_at;
+	uint64_t		next_number;
+	bool			full;
+	/* Measurements of the flow. */
+	uint64_t		blocks;
+	uint64_t		time_ns;
+	struct partial_file	partials[MAX_STREAMS];
+	unsigned int		n_partials;
+};
+
+/* State shared by all streams. */
+struct fill_state {
+	/* Protects the fields below and the output. */
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+
+	const char	*path;
+	int		dir_fd;
+	unsigned int	n_streams;
+	/* Threads other than a single stream print, so the streams only
+	 * announce a file along with its outcome, and wait_streams()
+	 * aggregates the progress.
+	 */
+	bool		shared_output;
+	/* The size of the files is 2^file_order bytes. */
+	unsigned int	file_order;
+	/* Next file to be written and last file to be written. */
+	uint64_t	next_number;
+	uint64_t	end_at;
+	bool		full;
+	unsigned int	n_running;
+	int		has_suggested_max_write_rate;
+
+	/* Blocks written by all streams, and their aggregated flow. */
+	uint64_t	written_blocks;
+	struct flow	agg_fw;
+
+	/* NULL if there is no journal. */
+	struct journal		*journal;
+	struct stream		*streams;
+	/* Files of the resumed run that are still to be finished. */
+	const struct partial_file *partials;
+	unsigned int		n_partials;
+	unsigned int		next_partial;
+
+	/* Files written and not yet validated by verify_files(). */
+	bool			verify;
+	uint64_t		verify_queue[MAX_STREAMS];
+	unsigned int		verify_head;
+	unsigned int		n_verify;
+	bool			writing_done;
+	/* Totals of the files validated. */
+	struct block_stats	verify_stats;
+	bool			verify_read_all;
+
+	/* Files finished in this run, for check_canaries(). */
+	unsigned int		n_canaries;
+	uint64_t		*done_files;
+	uint64_t		n_done_files;
+	uint64_t		done_files_size;
+	/* A canary found that the drive lost data after
+	 * @fake_at_blocks blocks were written.
+	 */
+	bool			fake;
+	uint64_t		fake_at_blocks;
+
+	/* Old files that remove_old_files() has not removed yet, and that
+	 * the streams have not claimed yet, are old_files[old_lo..old_hi).
+	 * The remover takes them from the last file down, while the streams
+	 * claim them from the first file up, so they only meet at one file.
+	 */
+	const uint64_t		*old_files;
+	uint64_t		old_lo;
+	uint64_t		old_hi;
+	/* The file being removed, if removing. */
+	bool			removing;
+	uint64_t		removing_number;
+};
+
+struct stream {
+	struct fill_state	*fs;
+	unsigned int		n_generators;
+	struct flow		fw;
+	struct pipeline		pl;
+	struct writer		wr;
+	pthread_t		thread;
+
+	/* The file being written, if busy, and how much of it reached
+	 * the drive at the last checkpoint; protected by fs->lock.
+	 */
+	bool			busy;
+	struct partial_file	file;
+	struct timespec		last_checkpoint;
+};
+
+static void print_journal_error(int rc)
+{
+	errx(1, "Can't save the journal: %s", strerror(rc));
+}
+
+/* The caller must hold fs->lock. */
+static void save_journal(struct fill_state *fs)
+{
+	const struct flow *fw = fs->shared_output
+		? &fs->agg_fw : &fs->streams[0].fw;
+	uint64_t blocks, time_ns;
+	unsigned int i;
+	int rc;
+	FILE *f;
+
+	if (!fs->journal)
+		return;
+	f = journal_start(fs->journal);
+	if (!f)
+		print_journal_error(errno);
+
+	fw_get_measurements(fw, &blocks, &time_ns);
+	fprintf(f, "f3write 1\n");
+	fprintf(f, "file_order %u\n", fs->file_order);
+	fprintf(f, "end_at %" PRIu64 "\n", fs->end_at);
+	fprintf(f, "next_number %" PRIu64 "\n", fs->next_number);
+	fprintf(f, "full %i\n", fs->full);
+	fprintf(f, "measured %" PRIu64 " %" PRIu64 "\n", blocks, time_ns);
+	for (i = 0; i < fs->n_streams; i++) {
+		const struct stream *st = &fs->streams[i];
+		if (st->busy)
+			fprintf(f, "partial %" PRIu64 " %" PRIu64 "\n",
+				st->file.number, st->file.pos);
+	}
+	for (i = fs->next_partial; i < fs->n_partials; i++)
+		fprintf(f, "partial %" PRIu64 " %" PRIu64 "\n",
+			fs->partials[i].number, fs->partials[i].pos);
+
+	rc = journal_commit(fs->journal, f);
+	if (rc)
+		print_journal_error(rc);
+}
+
+/* Return false if there is no journal. */
+static bool load_journal(const struct journal *j, struct write_journal *wj)
+{
+	FILE *f = journal_open(j);
+	char line[256];
+	unsigned int fields = 0;
+
+	if (!f) {
+		if (errno == ENOENT)
+			return false;
+		err(errno, "Can't open the journal");
+	}
+
+	memset(wj, 0, sizeof(*wj));
+	if (!fgets(line, sizeof(line), f) || strcmp(line, "f3write 1\n"))
+		errx(1, "The journal is not from f3write");
+	while (fgets(line, sizeof(line), f)) {
+		struct partial_file *pf = &wj->partials[wj->n_partials];
+		int full;
+
+		if (sscanf(line, "file_order %u", &wj->file_order) == 1) {
+			fields |= 1;
+		} else if (sscanf(line, "end_at %" SCNu64,
+				&wj->end_at) == 1) {
+			fields |= 2;
+		} else if (sscanf(line, "next_number %" SCNu64,
+				&wj->next_number) == 1) {
+			fields |= 4;
+		} else if (sscanf(line, "full %i", &full) == 1) {
+			wj->full = full;
+		} else if (sscanf(line, "measured %" SCNu64 " %" SCNu64,
+				&wj->blocks, &wj->time_ns) == 2) {
+		} else if (wj->n_partials < MAX_STREAMS &&
+				sscanf(line, "partial %" SCNu64 " %" SCNu64,
+				&pf->number, &pf->pos) == 2) {
+			wj->n_partials++;
+		} else {
+			errx(1, "Invalid line in the journal: %s", line);
+		}
+	}
+	fclose(f);
+
+	if (fields != 7 || wj->file_order < MIN_FILE_ORDER ||
+			wj->file_order > MAX_FILE_ORDER)
+		errx(1, "The journal is incomplete");
+	return true;
+}
+
+/* Push the data written so far to the drive, and record it in
+ * the journal.
+ */
+static int checkpoint(struct stream *st)
+{
+	struct fill_state *fs = st->fs;
+
+	if (fdatasync(st->wr.fd) < 0)
+		return errno;
+	assert(!pthread_mutex_lock(&fs->lock));
+	st->file.pos = st->wr.pos;
+	save_journal(fs);
+	assert(!pthread_mutex_unlock(&fs->lock));
+	assert(!clock_gettime(CLOCK_MONOTONIC, &st->last_checkpoint));
+	return 0;
+}
+
+/* Serialize the output of streams, and erase the aggregated progress. */
+static void lock_output(struct fill_state *fs)
+{
+	assert(!pthread_mutex_lock(&fs->lock));
+	clear_progress(&fs->agg_fw);
+}
+
+static void unlock_output(struct fill_state *fs)
+{
+	fflush(stdout);
+	assert(!pthread_mutex_unlock(&fs->lock));
+}
+
+static inline void announce_file(const char *filename, bool resuming)
+{
+	printf("%s file %s ... ", resuming ? "Resuming" : "Creating", filename);
+}
+
+/* A single stream announces a file before writing it; otherwise,
+ * streams only announce a file along with its outcome.
+ */
+static void start_file_report(struct fill_state *fs, const char *filename,
+	bool resuming)
+{
+	lock_output(fs);
+	if (fs->shared_output)
+		announce_file(filename, resuming);
+}
+
+/* With --verify-behind, a thread validates every file written while
+ * the streams write the next files. The pages of a file are dropped from
+ * the page cache before it is validated, so the data comes from the drive.
+ *
+ * A file may still be overwritten by a later file on a fake drive,
+ * so this validation does not replace f3read.
+ */
+
+#define VERIFY_BUF_SIZE	(4 * MEGABYTE_SIZE)
+
+/* Queue file @number to be validated; a stream only waits here when
+ * the verifier falls more than a file per stream behind.
+ */
+static void verify_behind(struct fill_state *fs, uint64_t number)
 {
+	if (!fs->verify)
+		return;
+
+	assert(!pthread_mutex_lock(&fs->lock));
+	while (fs->n_verify >= fs->n_streams)
+		assert(!pthread_cond_wait(&fs->cond, &fs->lock));
+	fs->verify_queue[(fs->verify_head + fs->n_verify) % MAX_STREAMS] =
+		number;
+	fs->n_verify++;
+	assert(!pthread_cond_broadcast(&fs->cond));
+	assert(!pthread_mutex_unlock(&fs->lock));
+}
+
+static void verify_file(struct fill_state *fs, char *buf, uint64_t number)
+{
+	const unsigned int block_order = fw_get_block_order(&fs->agg_fw);
+	struct block_stats stats = {0, 0, 0, 0};
+	uint64_t expected_offset = number << fs->file_order;
+	uint64_t pos = 0;
+	bool read_all = false;
+	char filename[MY_FILENAME_SIZE];
+	int fd, saved_errno = 0;
+	struct timespec t1, t2;
+
+	filename_from_number(filename, number);
+#ifdef __CYGWIN__
+	/* We don't need write access, but some kernels require that
+	 * the file descriptor passed to fdatasync(2) to be writable.
+	 */
+	fd = openat(fs->dir_fd, filename, O_RDWR);
+#else
+	fd = openat(fs->dir_fd, filename, O_RDONLY);
+#endif
+	if (fd < 0)
+		err(errno, "Can't open file %s/%s", fs->path, filename);
+
+	/* The pages of the file must be clean to be dropped. */
+	if (fdatasync(fd) < 0) {
+		saved_errno = errno;
+		goto report;
+	}
+	assert(!posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED));
+	assert(!posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL));
+
+	assert(!clock_gettime(CLOCK_MONOTONIC, &t1));
+	while (true) {
+		ssize_t rc = pread(fd, buf, VERIFY_BUF_SIZE, pos);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			saved_errno = errno;
+			break;
+		}
+		if (rc == 0) {
+			read_all = true;
+			break;
+		}
+		assert((rc & (SECTOR_SIZE - 1)) == 0);
+		check_buffer(buf, rc >> SECTOR_ORDER, &expected_offset, &stats);
+		pos += rc;
+	}
+	assert(!clock_gettime(CLOCK_MONOTONIC, &t2));
+
+report:
+	close(fd);
+	lock_output(fs);
+	printf("Validating file %s ... %7" PRIu64 "/%9" PRIu64 "/%7" PRIu64
+		"/%7" PRIu64, filename, stats.ok, stats.bad, stats.changed,
+		stats.overwritten);
+	if (!read_all) {
+		printf(" - NOT fully read due to \"%s\"",
+			strerror(saved_errno));
+	} else if (pos > 0) {
+		double speed = calc_avg_speed(block_order, pos >> block_order,
+			diff_timespec_ns(&t1, &t2));
+		const char *unit = adjust_unit(&speed);
+		printf(" Avg: %.2f %s/s", speed, unit);
+	}
+	printf("\n");
+	fs->verify_stats.ok += stats.ok;
+	fs->verify_stats.bad += stats.bad;
+	fs->verify_stats.changed += stats.changed;
+	fs->verify_stats.overwritten += stats.overwritten;
+	fs->verify_read_all = fs->verify_read_all && read_all;
+	unlock_output(fs);
+}
+
+static void *verify_files(void *arg)
+{
+	struct fill_state *fs = arg;
+	char *buf = aligned_alloc(fw_get_block_size(&fs->agg_fw),
+		VERIFY_BUF_SIZE);
+
+	if (!buf)
+		errx(1, "Can't allocate the buffer of the verifier");
+
+	do {
+		uint64_t number;
+
+		assert(!pthread_mutex_lock(&fs->lock));
+		while (fs->n_verify == 0 && !fs->writing_done)
+			assert(!pthread_cond_wait(&fs->cond, &fs->lock));
+		if (fs->n_verify == 0) {
+			assert(!pthread_mutex_unlock(&fs->lock));
+			break;
+		}
+		number = fs->verify_queue[fs->verify_head];
+		assert(!pthread_mutex_unlock(&fs->lock));
+
+		verify_file(fs, buf, number);
+
+		/* Free the entry only now, so the streams stay at most
+		 * a file per stream ahead of the verifier.
+		 */
+		assert(!pthread_mutex_lock(&fs->lock));
+		fs->verify_head = (fs->verify_head + 1) % MAX_STREAMS;
+		fs->n_verify--;
+		assert(!pthread_cond_broadcast(&fs->cond));
+		assert(!pthread_mutex_unlock(&fs->lock));
+	} while (true);
+
+	free(buf);
+	return NULL;
+}
+
+/* Blocks that removing file @number frees. */
+static uint64_t get_file_blocks(const char *path, int dir_fd,
+	uint64_t number, unsigned int block_order)
+{
+	const uint64_t block_size = 1ULL << block_order;
+	char filename[MY_FILENAME_SIZE];
+	struct stat st;
+
+	filename_from_number(filename, number);
+	if (fstatat(dir_fd, filename, &st, 0))
+		err(errno, "Can't stat file %s/%s", path, filename);
+	/* Preallocated files may hold more blocks than their size. */
+	return (((uint64_t)st.st_blocks << SECTOR_ORDER) + block_size - 1) >>
+		block_order;
+}
+
+static void *remove_old_files(void *arg)
+{
+	struct fill_state *fs = arg;
+
+	assert(!pthread_mutex_lock(&fs->lock));
+	while (fs->old_lo < fs->old_hi) {
+		char filename[MY_FILENAME_SIZE];
+
+		fs->removing = true;
+		fs->removing_number = fs->old_files[--fs->old_hi];
+		assert(!pthread_mutex_unlock(&fs->lock));
+
+		filename_from_number(filename, fs->removing_number);
+		if (unlinkat(fs->dir_fd, filename, 0))
+			err(errno, "Can't remove file %s/%s", fs->path, filename);
+
+		/* Wake up the streams waiting for this file or for space. */
+		assert(!pthread_mutex_lock(&fs->lock));
+		fs->removing = false;
+		assert(!pthread_cond_broadcast(&fs->cond));
+	}
+	assert(!pthread_mutex_unlock(&fs->lock));
+	return NULL;
+}
+
+/* Claim the old file @number, if any, since creating the file truncates
+ * the old one. Then, wait until there is space for the file or
+ * nothing else to remove; the old file may be smaller than the new one
+ * because it was the last file of its run or the run used
+ * another --file-size.
+ *
+ * The caller must hold fs->lock, and must claim files in ascending order.
+ */
+static void claim_old_file(struct fill_state *fs, uint64_t number)
+{
+	const unsigned int block_order = fw_get_block_order(&fs->agg_fw);
+	const uint64_t file_blocks = 1ULL << (fs->file_order - block_order);
+	uint64_t needed_blocks = file_blocks;
+
+	while (fs->removing && fs->removing_number == number)
+		assert(!pthread_cond_wait(&fs->cond, &fs->lock));
+
+	if (fs->old_lo < fs->old_hi && fs->old_files[fs->old_lo] == number) {
+		const uint64_t old_blocks = get_file_blocks(fs->path,
+			fs->dir_fd, number, block_order);
+		fs->old_lo++;
+		needed_blocks = old_blocks < file_blocks
+			? file_blocks - old_blocks : 0;
+	}
+
+	while (needed_blocks > 0 &&
+			(fs->old_lo < fs->old_hi || fs->removing) &&
+			get_free_blocks(fs->path) < needed_blocks)
+		assert(!pthread_cond_wait(&fs->cond, &fs->lock));
+}
+
+/* Write file @number from byte @start_pos on.
+ * Return true when disk is full.
+ */
+static int create_and_fill_file(struct stream *st, uint64_t number,
+	uint64_t start_pos)
+{
+	struct fill_state *fs = st->fs;
+	struct flow *fw = &st->fw;
+	struct writer *wr = &st->wr;
+	struct pipeline *pl = wr->pl;
 	const unsigned int block_size = fw_get_block_size(fw);
 	const unsigned int block_order = fw_get_block_order(fw);
 	const uint64_t total_file_blocks =
-		1ULL << (GIGABYTE_ORDER - block_order);
-	uint64_t remaining_blocks = total_file_blocks;
+		1ULL << (fs->file_order - block_order);
+	uint64_t remaining_blocks;
 	double file_min_speed = INFINITY;
 	double file_max_speed = -INFINITY;
 	uint64_t file_tot_blocks = 0;
 	uint64_t file_tot_time_ns = 0;
 	uint64_t file_speed_samples = 0;
-	char *full_fn;
-	const char *filename;
+	char filename[MY_FILENAME_SIZE];
 	int fd, saved_errno;
-	uint64_t offset;
+	struct generator gen;
+	pthread_t threads[MAX_GENERATORS];
+	unsigned int i;
 	struct timespec file_t1, file_t2;
 
-	assert(GIGABYTE_ORDER >= block_order);
+	assert(fs->file_order >= block_order);
 
 	/* Create the file. */
-	full_fn = full_fn_from_number(&filename, path, number);
-	assert(full_fn);
-	printf("Creating file %s ... ", filename);
-	fflush(stdout);
-	fd = open(full_fn, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	filename_from_number(filename, number);
+	if (!fs->shared_output) {
+		announce_file(filename, start_pos > 0);
+		fflush(stdout);
+	}
+	fd = openat(fs->dir_fd, filename,
+		O_CREAT | O_WRONLY | (start_pos > 0 ? 0 : O_TRUNC),
+		S_IRUSR | S_IWUSR);
 	if (fd < 0) {
 		if (errno == ENOSPC) {
+			start_file_report(fs, filename, start_pos > 0);
 			printf("No space left.\n");
-			free(full_fn);
+			unlock_output(fs);
 			return true;
 		}
-		err(errno, "Can't create file %s", full_fn);
+		err(errno, "Can't create file %s/%s", fs->path, filename);
 	}
 	assert(fd >= 0);
 
+	if (start_pos > 0) {
+		/* Drop what was written after the last checkpoint, or
+		 * start over if the file lost data that reached the drive.
+		 */
+		struct stat stat;
+		if (fstat(fd, &stat))
+			err(errno, "Can't stat file %s/%s", fs->path, filename);
+		if ((uint64_t)stat.st_size < start_pos)
+			start_pos = 0;
+		if (ftruncate(fd, start_pos))
+			err(errno, "Can't truncate file %s/%s", fs->path,
+				filename);
+	}
+	assert((start_pos & (block_size - 1)) == 0);
+	remaining_blocks = total_file_blocks - (start_pos >> block_order);
+
+	if (wr->direct) {
+		saved_errno = set_direct_io(fd);
+		if (saved_errno) {
+			lock_output(fs);
+			printf("\nWARNING: Can't bypass the page cache: %s\nF3 Write will use the page cache from now on.\n\n",
+				strerror(saved_errno));
+			unlock_output(fs);
+			wr->direct = false;
+		}
+	}
+
+	/* Start the generation of the content. */
+	assert(st->n_generators <= MAX_GENERATORS);
+	gen.pl = pl;
+	gen.offset = (number << fs->file_order) + start_pos;
+	gen.size = (total_file_blocks << block_order) - start_pos;
+	gen.streaming = is_larger_than_cache(pl_get_size(pl));
+
+	/* This is only an optimization, so failures are ignored;
+	 * for example, the last file does not fit in the free space.
+	 */
+	preallocate_file(fd, total_file_blocks << block_order);
+	pl_start(pl, (gen.size + pl_get_slot_size(pl) - 1) /
+		pl_get_slot_size(pl));
+	for (i = 0; i < st->n_generators; i++) {
+		saved_errno = pthread_create(&threads[i], NULL, generate_file,
+			&gen);
+		if (saved_errno)
+			errx(1, "Can't create thread: %s",
+				strerror(saved_errno));
+	}
+	start_writer(wr, fd, start_pos);
+
 	/* Write content. */
 	saved_errno = 0;
-	offset = number << GIGABYTE_ORDER;
 	assert(!clock_gettime(CLOCK_MONOTONIC, &file_t1));
 	start_measurement(fw);
 	while (remaining_blocks > 0) {
@@ -224,18 +1081,13 @@ static int create_and_fill_file(struct flow *fw, struct dynamic_buffer *dbuf,
 		uint64_t written_blocks;
 		struct fw_measurement m;
 
-		saved_errno = write_chunk(fw, dbuf, fd, remaining_blocks,
-			&offset, &bytes_written);
+		saved_errno = write_chunk(fw, wr, remaining_blocks,
+			&bytes_written);
 		if (bytes_written == 0)
 			break;
 
-		/* Push data to drive and tip the kernel. */
-		if (fdatasync(fd) < 0) {
-			/* Preserve the first error. */
-			if (saved_errno == 0)
-				saved_errno = errno;
-		}
-		if (saved_errno == 0) {
+		/* Tip the kernel. */
+		if (saved_errno == 0 && !wr->direct) {
 			saved_errno = posix_fadvise(fd, 0, 0,
 				POSIX_FADV_DONTNEED);
 		}
@@ -256,14 +1108,33 @@ static int create_and_fill_file(struct flow *fw, struct dynamic_buffer *dbuf,
 		}
 		remaining_blocks -= written_blocks;
 
+		assert(!pthread_mutex_lock(&fs->lock));
+		fs->written_blocks += written_blocks;
+		assert(!pthread_mutex_unlock(&fs->lock));
+
+		if (saved_errno == 0 && fs->journal && remaining_blocks > 0) {
+			struct timespec now;
+			assert(!clock_gettime(CLOCK_MONOTONIC, &now));
+			if (diff_timespec_ns(&st->last_checkpoint, &now) >=
+					CHECKPOINT_INTERVAL_NS)
+				saved_errno = checkpoint(st);
+		}
+
 		if (saved_errno != 0)
 			break;
 	}
 	end_measurement(fw);
 	assert(!clock_gettime(CLOCK_MONOTONIC, &file_t2));
+
+	/* The generators may be waiting for slots that will never be
+	 * written if the file is incomplete.
+	 */
+	pl_stop(pl);
+	for (i = 0; i < st->n_generators; i++)
+		assert(!pthread_join(threads[i], NULL));
 	close(fd);
-	free(full_fn);
 
+	start_file_report(fs, filename, start_pos > 0);
 	if (saved_errno == 0 || saved_errno == ENOSPC) {
 		uint64_t file_time_ns = diff_timespec_ns(&file_t1, &file_t2);
 		double file_avg_speed;
@@ -279,7 +1150,7 @@ static int create_and_fill_file(struct flow *fw, struct dynamic_buffer *dbuf,
 				file_speed_samples);
 		} else if (file_time_ns > 0) {
 			const uint64_t blocks_written =
-				total_file_blocks - remaining_blocks;
+				(gen.size >> block_order) - remaining_blocks;
 			if (file_tot_blocks == blocks_written &&
 				file_tot_time_ns > 0) {
 				file_time_ns = file_tot_time_ns;
@@ -292,19 +1163,226 @@ static int create_and_fill_file(struct flow *fw, struct dynamic_buffer *dbuf,
 		} else {
 			printf("OK!\n");
 		}
+		unlock_output(fs);
+		verify_behind(fs, number);
 		return saved_errno == ENOSPC;
 	}
 
 	/* Something went wrong. */
 	assert(saved_errno != 0);
 	printf("Write failure: %s\n", strerror(saved_errno));
-	if (saved_errno == EIO && !*phas_suggested_max_write_rate) {
-		*phas_suggested_max_write_rate = true;
+	if (saved_errno == EIO && !fs->has_suggested_max_write_rate) {
+		fs->has_suggested_max_write_rate = true;
 		printf("\nWARNING:\nThe write error above may be due to your memory card overheating\nunder constant, maximum write rate. You can test this hypothesis\ntouching your memory card. If it is hot, you can try f3write\nagain, once your card has cooled down, using parameter --max-write-rate=2048\nto limit the maximum write rate to 2MB/s, or another suitable rate.\n\n");
 	}
+	unlock_output(fs);
+	verify_behind(fs, number);
 	return false;
 }
 
+/* With --canary, a stream that finishes a file reads random blocks of
+ * the files finished before it, bypassing the page cache. Once a fake
+ * drive is full, new writes wrap around and overwrite earlier files,
+ * so a lost block stops f3write long before it fills the fake capacity.
+ */
+
+struct canary {
+	uint64_t	number;
+	/* Position of the block in the file. */
+	uint64_t	pos;
+};
+
+static inline uint64_t uint64_rand(void)
+{
+	/* See uint64_rand() in libprobe.c. */
+	return ((uint64_t)rand() << 32) ^ rand();
+}
+
+/* Return true if the block of @canary was lost. */
+static bool check_canary(struct fill_state *fs, const struct canary *canary,
+	char *buf)
+{
+	const unsigned int block_size = fw_get_block_size(&fs->agg_fw);
+	const uint64_t offset = (canary->number << fs->file_order) +
+		canary->pos;
+	enum block_state state = bs_good;
+	uint64_t found_offset;
+	char filename[MY_FILENAME_SIZE];
+	ssize_t rc;
+	int fd, saved_errno = 0;
+	unsigned int i = 0;
+
+	filename_from_number(filename, canary->number);
+	fd = openat(fs->dir_fd, filename, O_RDONLY);
+	if (fd < 0) {
+		/* There was no space left to create the file. */
+		if (errno == ENOENT)
+			return false;
+		err(errno, "Can't open file %s/%s", fs->path, filename);
+	}
+	/* Without direct I/O, drop the block from the page cache. */
+	if (set_direct_io(fd))
+		posix_fadvise(fd, canary->pos, block_size, POSIX_FADV_DONTNEED);
+	rc = pread(fd, buf, block_size, canary->pos);
+	if (rc < 0)
+		saved_errno = errno;
+	close(fd);
+
+	/* A short read means that the block is past the end of a file
+	 * that did not fit in the drive.
+	 */
+	for (; rc > 0 && i < (size_t)rc >> SECTOR_ORDER; i++) {
+		state = validate_buffer_with_block(buf + (i << SECTOR_ORDER),
+			SECTOR_ORDER, offset + (i << SECTOR_ORDER),
+			&found_offset, 0);
+		/* A few flipped bits are not a sign of a fake drive. */
+		if (state == bs_bad || state == bs_overwritten)
+			break;
+		state = bs_good;
+	}
+	if (rc >= 0 && state == bs_good)
+		return false;
+
+	lock_output(fs);
+	if (rc < 0) {
+		printf("\nCanary: the block at byte %" PRIu64 " of file %s can't be read: %s\n",
+			canary->pos, filename, strerror(saved_errno));
+	} else {
+		printf("\nCanary: the sector at byte %" PRIu64 " of file %s is %s\n",
+			canary->pos + (i << SECTOR_ORDER), filename,
+			block_state_to_str(state));
+	}
+	unlock_output(fs);
+	return true;
+}
+
+/* Check the canaries of the files finished before file @number, and
+ * add file @number to them. Return true if the drive lost data.
+ */
+static bool check_canaries(struct fill_state *fs, uint64_t number)
+{
+	const unsigned int block_order = fw_get_block_order(&fs->agg_fw);
+	const uint64_t file_blocks = 1ULL << (fs->file_order - block_order);
+	struct canary canaries[MAX_CANARIES];
+	unsigned int i, n = 0;
+	bool fake = false;
+
+	if (!fs->n_canaries)
+		return false;
+
+	/* rand() is only called with the lock held. */
+	assert(!pthread_mutex_lock(&fs->lock));
+	if (fs->n_done_files > 0 && !fs->fake) {
+		n = fs->n_canaries;
+		for (i = 0; i < n; i++) {
+			canaries[i].number = fs->done_files[uint64_rand() %
+				fs->n_done_files];
+			canaries[i].pos = (uint64_rand() % file_blocks) <<
+				block_order;
+		}
+	}
+	assert(!pthread_mutex_unlock(&fs->lock));
+
+	if (n > 0) {
+		char *buf = aligned_alloc(1U << block_order, 1U << block_order);
+		if (!buf)
+			errx(1, "Can't allocate the buffer of the canaries");
+		for (i = 0; i < n && !fake; i++)
+			fake = check_canary(fs, &canaries[i], buf);
+		free(buf);
+	}
+
+	assert(!pthread_mutex_lock(&fs->lock));
+	if (fs->n_done_files == fs->done_files_size) {
+		fs->done_files_size = fs->done_files_size
+			? 2 * fs->done_files_size : 64;
+		fs->done_files = realloc(fs->done_files,
+			fs->done_files_size * sizeof(*fs->done_files));
+		if (!fs->done_files)
+			errx(1, "Can't allocate the list of files written");
+	}
+	fs->done_files[fs->n_done_files++] = number;
+	if (fake && !fs->fake) {
+		fs->fake = true;
+		fs->fake_at_blocks = fs->written_blocks;
+	}
+	assert(!pthread_mutex_unlock(&fs->lock));
+	return fake;
+}
+
+static void *write_stream(void *arg)
+{
+	struct stream *st = arg;
+	struct fill_state *fs = st->fs;
+
+	do {
+		bool full;
+
+		assert(!pthread_mutex_lock(&fs->lock));
+		/* Finish the files of the resumed run first. */
+		if (!fs->fake && fs->next_partial < fs->n_partials) {
+			st->file = fs->partials[fs->next_partial++];
+		} else if (fs->full || fs->fake ||
+				fs->next_number > fs->end_at) {
+			fs->n_running--;
+			assert(!pthread_cond_broadcast(&fs->cond));
+			assert(!pthread_mutex_unlock(&fs->lock));
+			break;
+		} else {
+			st->file.number = fs->next_number++;
+			st->file.pos = 0;
+			claim_old_file(fs, st->file.number);
+		}
+		st->busy = true;
+		assert(!pthread_mutex_unlock(&fs->lock));
+
+		assert(!clock_gettime(CLOCK_MONOTONIC, &st->last_checkpoint));
+		full = create_and_fill_file(st, st->file.number, st->file.pos);
+		check_canaries(fs, st->file.number);
+
+		assert(!pthread_mutex_lock(&fs->lock));
+		st->busy = false;
+		if (full)
+			fs->full = true;
+		save_journal(fs);
+		assert(!pthread_mutex_unlock(&fs->lock));
+	} while (true);
+	return NULL;
+}
+
+/* Wait for the streams, and account their aggregated progress
+ * once a second.
+ */
+static void wait_streams(struct fill_state *fs)
+{
+	struct timespec last, now, deadline;
+	uint64_t last_blocks = 0;
+
+	assert(!clock_gettime(CLOCK_MONOTONIC, &last));
+	assert(!pthread_mutex_lock(&fs->lock));
+	do {
+		int rc;
+
+		/* Condition variables wait on the realtime clock. */
+		assert(!clock_gettime(CLOCK_REALTIME, &deadline));
+		deadline.tv_sec++;
+		rc = pthread_cond_timedwait(&fs->cond, &fs->lock, &deadline);
+		assert(rc == 0 || rc == ETIMEDOUT);
+
+		assert(!clock_gettime(CLOCK_MONOTONIC, &now));
+		if (fs->n_running == 0 ||
+				diff_timespec_ns(&last, &now) >= 1000000000ULL) {
+			add_measurement(&fs->agg_fw,
+				fs->written_blocks - last_blocks,
+				diff_timespec_ns(&last, &now));
+			last_blocks = fs->written_blocks;
+			last = now;
+		}
+	} while (fs->n_running > 0);
+	clear_progress(&fs->agg_fw);
+	assert(!pthread_mutex_unlock(&fs->lock));
+}
+
 static inline void pr_freespace(uint64_t fs)
 {
 	double f = (double)fs;
@@ -312,15 +1390,44 @@ static inline void pr_freespace(uint64_t fs)
 	printf("Free space: %.2f %s\n", f, unit);
 }
 
-static int fill_fs(const char *path, uint64_t start_at, uint64_t end_at,
-	uint64_t max_write_rate, int progress)
+/* Blocks that removing @files frees. */
+static uint64_t get_files_blocks(const char *path, int dir_fd,
+	const uint64_t *files, unsigned int block_order)
+{
+	uint64_t blocks = 0;
+
+	for (; *files != (uint64_t)-1; files++)
+		blocks += get_file_blocks(path, dir_fd, *files, block_order);
+	return blocks;
+}
+
+/* If @wj is not NULL, resume the run it records;
+ * @start_at is then its next file.
+ * Old files in @old_files are removed while the new files are written;
+ * @old_files can be NULL.
+ */
+static int fill_fs(const char *path, int dir_fd,
+	uint64_t start_at, uint64_t end_at, const uint64_t *old_files,
+	struct pacer *pacer, unsigned int queue_depth, bool direct,
+	unsigned int n_streams, unsigned int file_order, bool verify,
+	unsigned int n_canaries, struct journal *journal,
+	const struct write_journal *wj, int progress)
 {
 	const unsigned int block_order = get_block_order(path);
-	uint64_t free_blocks = get_free_blocks(path);
-	struct flow fw;
-	struct dynamic_buffer dbuf;
+	const uint64_t old_blocks = old_files
+		? get_files_blocks(path, dir_fd, old_files, block_order) : 0;
+	uint64_t free_blocks = get_free_blocks(path) + old_blocks;
+	const unsigned int n_partials = wj ? wj->n_partials : 0;
+	const uint64_t resumed_blocks = wj ? wj->blocks : 0;
+	unsigned int n_generators =
+		pl_get_n_workers(MAX_GENERATORS) / n_streams;
+	uint64_t n_files, wanted_blocks;
+	struct fill_state fs;
+	struct stream *streams;
+	pthread_t verifier, remover;
+	bool has_old_files;
 	uint64_t i;
-	int has_suggested_max_write_rate = max_write_rate > 0;
+	int rc;
 
 	pr_freespace(free_blocks << block_order);
 	if (free_blocks == 0) {
@@ -328,57 +1435,203 @@ static int fill_fs(const char *path, uint64_t start_at, uint64_t end_at,
 		return 1;
 	}
 
-	assert(start_at <= end_at);
-	assert(GIGABYTE_ORDER >= block_order);
-	i = end_at - start_at + 1;
-	if (i <= (free_blocks >> (GIGABYTE_ORDER - block_order))) {
+	assert(file_order >= block_order);
+	/* A resumed run may have no new file to write. */
+	n_files = start_at <= end_at && !(wj && wj->full)
+		? end_at - start_at + 1 : 0;
+	wanted_blocks = n_files << (file_order - block_order);
+	for (i = 0; i < n_partials; i++) {
+		wanted_blocks += ((1ULL << file_order) - wj->partials[i].pos)
+			>> block_order;
+	}
+	if (wanted_blocks <= free_blocks) {
 		/* The amount of data to write is less than the space available,
 		 * update free_blocks to improve estimate of time to finish.
 		 */
-		free_blocks = i << (GIGABYTE_ORDER - block_order);
-	} else {
+		free_blocks = wanted_blocks;
+	} else if (n_files > 0) {
 		/* There are more data to write than space available.
 		 * Reduce end_at to reduce the number of error messages
 		 * due to multiple write failures.
 		 */
 		end_at = start_at +
-			(free_blocks >> (GIGABYTE_ORDER - block_order));
+			(free_blocks >> (file_order - block_order));
+		n_files = end_at - start_at + 1;
 	}
 
-	init_flow(&fw, block_order, free_blocks, max_write_rate,
-		(GIGABYTE_SIZE >> block_order),
+	/* There is no point in having more streams than files. */
+	if (n_streams > n_files + n_partials)
+		n_streams = n_files + n_partials;
+	if (n_streams < 1)
+		n_streams = 1;
+	if (n_generators < 1)
+		n_generators = 1;
+
+	assert(!pthread_mutex_init(&fs.lock, NULL));
+	assert(!pthread_cond_init(&fs.cond, NULL));
+	fs.path = path;
+	fs.dir_fd = dir_fd;
+	fs.n_streams = n_streams;
+	fs.shared_output = n_streams > 1 || verify;
+	fs.file_order = file_order;
+	fs.next_number = start_at;
+	fs.end_at = end_at;
+	fs.full = wj && wj->full;
+	fs.n_running = n_streams;
+	fs.has_suggested_max_write_rate = pc_is_limited(pacer);
+	fs.written_blocks = 0;
+	init_flow(&fs.agg_fw, block_order, resumed_blocks + free_blocks,
+		FW_MAX_PROCESS_RATE_NONE, FW_MAX_BLOCKS_PER_DELAY_NONE,
 		progress ? printf_flush_cb : dummy_cb, 0);
-	dbuf_init(&dbuf);
-	for (i = start_at; i <= end_at; i++) {
-		if (create_and_fill_file(&fw, &dbuf, path, i,
-				&has_suggested_max_write_rate))
-			break;
+	fs.journal = journal;
+	fs.partials = wj ? wj->partials : NULL;
+	fs.n_partials = n_partials;
+	fs.next_partial = 0;
+	fs.verify = verify;
+	fs.verify_head = 0;
+	fs.n_verify = 0;
+	fs.writing_done = false;
+	memset(&fs.verify_stats, 0, sizeof(fs.verify_stats));
+	fs.verify_read_all = true;
+	fs.n_canaries = n_canaries;
+	fs.done_files = NULL;
+	fs.n_done_files = 0;
+	fs.done_files_size = 0;
+	fs.fake = false;
+	fs.fake_at_blocks = 0;
+	fs.old_files = old_files;
+	fs.old_lo = 0;
+	fs.old_hi = 0;
+	while (old_files && old_files[fs.old_hi] != (uint64_t)-1)
+		fs.old_hi++;
+	fs.removing = false;
+	has_old_files = fs.old_hi > 0;
+	if (n_canaries)
+		srand(time(NULL));
+
+	streams = calloc(n_streams, sizeof(*streams));
+	if (!streams)
+		errx(1, "Can't allocate the streams");
+	fs.streams = streams;
+	for (i = 0; i < n_streams; i++) {
+		struct stream *st = &streams[i];
+
+		st->fs = &fs;
+		st->n_generators = n_generators;
+		/* The writers pace the writes, so the flows do not
+		 * limit the rate.
+		 */
+		if (!fs.shared_output) {
+			init_flow(&st->fw, block_order,
+				resumed_blocks + free_blocks,
+				FW_MAX_PROCESS_RATE_NONE,
+				(1ULL << (file_order - block_order)),
+				progress ? printf_flush_cb : dummy_cb, 0);
+		} else {
+			/* The progress is aggregated by wait_streams(). */
+			init_flow(&st->fw, block_order, free_blocks,
+				FW_MAX_PROCESS_RATE_NONE,
+				(1ULL << (file_order - block_order)), dummy_cb, 0);
+		}
+		/* Two slots per generator let generators work while
+		 * the writes in flight hold slots.
+		 */
+		rc = pl_init(&st->pl, 2 * n_generators + queue_depth,
+			SLOT_SIZE, block_order);
+		if (rc)
+			errx(1, "Can't allocate buffers: %s", strerror(rc));
+		init_writer(&st->wr, &st->pl, queue_depth, direct, pacer);
+	}
+	if (wj) {
+		fw_resume_measurements(fs.shared_output ? &fs.agg_fw
+			: &streams[0].fw, wj->blocks, wj->time_ns);
+	}
+
+	/* Record the start of a new run right away, so a stale journal
+	 * never describes the files of this run.
+	 */
+	save_journal(&fs);
+
+	if (has_old_files) {
+		printf("Removing %" PRIu64 " old files while writing\n",
+			fs.old_hi);
+		rc = pthread_create(&remover, NULL, remove_old_files, &fs);
+		if (rc)
+			errx(1, "Can't create thread: %s", strerror(rc));
+	}
+
+	if (verify) {
+		printf("                  SECTORS      ok/corrupted/changed/overwritten\n");
+		rc = pthread_create(&verifier, NULL, verify_files, &fs);
+		if (rc)
+			errx(1, "Can't create thread: %s", strerror(rc));
+	}
+
+	if (!fs.shared_output) {
+		write_stream(&streams[0]);
+	} else {
+		for (i = 0; i < n_streams; i++) {
+			rc = pthread_create(&streams[i].thread, NULL,
+				write_stream, &streams[i]);
+			if (rc)
+				errx(1, "Can't create thread: %s",
+					strerror(rc));
+		}
+		wait_streams(&fs);
+		for (i = 0; i < n_streams; i++)
+			assert(!pthread_join(streams[i].thread, NULL));
 	}
-	dbuf_free(&dbuf);
+
+	if (verify) {
+		assert(!pthread_mutex_lock(&fs.lock));
+		fs.writing_done = true;
+		assert(!pthread_cond_broadcast(&fs.cond));
+		assert(!pthread_mutex_unlock(&fs.lock));
+		assert(!pthread_join(verifier, NULL));
+	}
+
+	/* The free space below must include the removed files. */
+	if (has_old_files)
+		assert(!pthread_join(remover, NULL));
 
 	/* Final report. */
+	if (fs.fake) {
+		double f = (double)(fs.fake_at_blocks << block_order);
+		const char *unit = adjust_unit(&f);
+		printf("\nFAKE CAPACITY DETECTED at %.2f %s: the drive lost data written before, so F3 Write stopped early.\nRun f3read to find out how much data the drive keeps.\n\n",
+			f, unit);
+	}
 	pr_freespace(get_free_blocks(path) << block_order);
-	print_avg_seq_speed(&fw, "write", true);
-	return 0;
-}
+	if (!fs.shared_output) {
+		print_avg_seq_speed(&streams[0].fw, "write", true);
+	} else {
+		/* Only several streams have speeds of their own. */
+		for (i = 0; n_streams > 1 && i < n_streams; i++) {
+			char speed_type[64];
+			snprintf(speed_type, sizeof(speed_type),
+				"write (stream %" PRIu64 ")", i + 1);
+			print_avg_seq_speed(&streams[i].fw, speed_type, true);
+		}
+		print_avg_seq_speed(&fs.agg_fw, "write", true);
+	}
 
-static void unlink_old_files(const char *path,
-	uint64_t start_at, uint64_t end_at)
-{
-	const uint64_t *files = ls_my_files(path, start_at, end_at);
-	const uint64_t *number = files;
-	while (*number != (uint64_t)-1) {
-		char *full_fn;
-		const char *filename;
-		full_fn = full_fn_from_number(&filename, path, *number);
-		assert(full_fn);
-		printf("Removing old file %s ...\n", filename);
-		if (unlink(full_fn))
-			err(errno, "Can't remove file %s", full_fn);
-		number++;
-		free(full_fn);
+	if (verify) {
+		printf("\nValidation of the files right after writing them:");
+		print_stats(&fs.verify_stats, SECTOR_ORDER, "sector");
+		if (!fs.verify_read_all)
+			printf("WARNING: Not all data was read due to I/O error(s)\n");
+		printf("Files written later may still overwrite these files on a fake drive; run f3read to validate all files together.\n");
 	}
-	free((void *)files);
+
+	for (i = 0; i < n_streams; i++) {
+		free_writer(&streams[i].wr);
+		pl_free(&streams[i].pl);
+	}
+	free(streams);
+	free(fs.done_files);
+	pthread_cond_destroy(&fs.cond);
+	pthread_mutex_destroy(&fs.lock);
+	return 0;
 }
 
 int main(int argc, char **argv)
@@ -388,18 +1641,67 @@ int main(int argc, char **argv)
 		.start_at	= 0,
 		.end_at		= LONG_MAX - 1,
 		.max_write_rate = FW_MAX_PROCESS_RATE_NONE,
+		.max_write_iops	= PC_MAX_IOPS_NONE,
+		.burst_ms	= 100,
+		.queue_depth	= 4,
+		.direct		= false,
+		.n_streams	= 1,
+		.file_order	= DEFAULT_FILE_ORDER,
+		.verify_behind	= false,
+		.n_canaries	= 0,
+		.journal_filename = NULL,
+		.resume		= false,
 		/* If stdout isn't a terminal, suppress progress. */
 		.show_progress	= isatty(STDOUT_FILENO),
 	};
+	struct journal journal;
+	struct write_journal wj;
+	struct pacer pacer;
+	const uint64_t *old_files = NULL;
+	bool resumed = false;
+	int dir_fd, rc;
 
 	/* Read parameters. */
 	argp_parse(&argp, argc, argv, 0, NULL, &args);
 	print_header(stdout, "write");
 
+	/* The journal is on the host, so open it before
+	 * adjust_dev_path() changes the root directory.
+	 */
+	if (args.journal_filename) {
+		rc = journal_init(&journal, args.journal_filename);
+		if (rc)
+			errx(1, "Can't open the journal `%s': %s",
+				args.journal_filename, strerror(rc));
+		if (args.resume)
+			resumed = load_journal(&journal, &wj);
+	}
+
 	adjust_dev_path(&args.dev_path);
+	dir_fd = open_dir(args.dev_path);
 
-	unlink_old_files(args.dev_path, args.start_at, args.end_at);
+	if (resumed) {
+		printf("Resuming the run recorded in the journal\n");
+		args.start_at = wj.next_number;
+		args.end_at = wj.end_at;
+		args.file_order = wj.file_order;
+	} else {
+		old_files = ls_my_files(dir_fd, args.start_at, args.end_at);
+	}
 
-	return fill_fs(args.dev_path, args.start_at, args.end_at,
-		args.max_write_rate, args.show_progress);
+	init_pacer(&pacer, args.max_write_rate, args.max_write_iops,
+		args.burst_ms * 1000000ULL);
+	rc = fill_fs(args.dev_path, dir_fd, args.start_at, args.end_at,
+		old_files,
+		&pacer, args.queue_depth, args.direct,
+		args.n_streams, args.file_order, args.verify_behind,
+		args.n_canaries,
+		args.journal_filename ? &journal : NULL,
+		resumed ? &wj : NULL, args.show_progress);
+	free_pacer(&pacer);
+	free((void *)old_files);
+	close(dir_fd);
+	if (args.journal_filename)
+		journal_free(&journal);
+	return rc;
 }
@@ -1283,8 +1283,9 @@ void sdev_recover(struct device *dev, uint64_t very_last_pos)
 	struct safe_device *sdev = dev_sdev(dev);
 	const int block_order = dev_get_block_order(sdev->shadow_dev);
 	char *first_block = sdev->saved_blocks;
-	uint64_t i, first_pos, last_pos;
-	char *start_buf;
+	/* Only used while has_seq is true. */
+	uint64_t i, first_pos = 0, last_pos = 0;
+	char *start_buf = NULL;
 	int has_seq;
 
 	has_seq = false;
@@ -4,10 +4,10 @@
 
 #define _DARWIN_C_SOURCE
 
-#include <fcntl.h>	/* For fcntl().	*/
-
 #endif	/* Apple Macintosh */
 
+#include <fcntl.h>	/* For fcntl().	*/
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -20,8 +20,24 @@
 #include <errno.h>
 #include <err.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/statvfs.h>
 
+#ifdef __linux__
+#include <sys/stat.h>
+#include <sys/sysmacros.h>	/* For major() and minor().	*/
+#include <sys/ioctl.h>
+#include <linux/fs.h>		/* For FS_IOC_FIEMAP.	*/
+#include <linux/fiemap.h>
+#if defined(__has_include) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>	/* For struct iovec.	*/
+#define HAVE_IO_URING
+#endif
+#endif	/* Linux */
+
 #include "libfile.h"
 #include "libutils.h"
 
@@ -73,12 +89,19 @@ int is_my_file(const char *filename)
 		(p[3] == 'w') && (p[4] == '\0');
 }
 
-char *full_fn_from_number(const char **filename, const char *path, uint64_t num)
+char *filename_from_number(char *filename, uint64_t num)
 {
-	char *str;
-	assert(asprintf(&str, "%s/%" PRIu64 ".h2w", path, num + 1) > 0);
-	*filename = str + strlen(path) + 1;
-	return str;
+	assert(snprintf(filename, MY_FILENAME_SIZE, "%" PRIu64 ".h2w",
+		num + 1) < MY_FILENAME_SIZE);
+	return filename;
+}
+
+int open_dir(const char *path)
+{
+	int dir_fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (dir_fd < 0)
+		err(errno, "Can't open path %s", path);
+	return dir_fd;
 }
 
 static uint64_t number_from_filename(const char *filename)
@@ -109,89 +132,840 @@ static inline bool include_this_file(const char *filename,
 	return start_at <= *number && *number <= end_at;
 }
 
-static uint64_t count_files(const char *path,
-	uint64_t start_at, uint64_t end_at)
+/* To be used with qsort(3). */
+static int cmpintp(const void *p1, const void *p2)
 {
-	DIR *dir = opendir(path);
+	if (*(const uint64_t *)p1 < *(const uint64_t *)p2)
+		return -1;
+	return *(const uint64_t *)p1 > *(const uint64_t *)p2;
+}
+
+const uint64_t *ls_my_files(int dir_fd, uint64_t start_at, uint64_t end_at)
+{
+	/* The new descriptor shares the position in the directory
+	 * with @dir_fd, so the scan starts with a rewind.
+	 */
+	const int fd = dup(dir_fd);
+	DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
 	struct dirent *entry;
-	uint64_t dummy, total = 0;
+	uint64_t *ret = NULL;
+	uint64_t n_files = 0, size = 0;
 
 	if (!dir)
-		err(errno, "Can't open path %s at %s()", path, __func__);
+		err(errno, "Can't open the directory at %s()", __func__);
+	rewinddir(dir);
 
-	entry = readdir(dir);
-	while (entry) {
-		if (include_this_file(entry->d_name, start_at, end_at, &dummy))
-			total++;
-		entry = readdir(dir);
+	/* A single pass over the directory; the list grows as needed. */
+	while ((entry = readdir(dir)) != NULL) {
+		uint64_t number;
+		if (!include_this_file(entry->d_name, start_at, end_at,
+				&number))
+			continue;
+		/* Leave room for the terminator. */
+		if (n_files + 1 >= size) {
+			size = size ? 2 * size : 64;
+			ret = realloc(ret, sizeof(*ret) * size);
+			assert(ret);
+		}
+		ret[n_files++] = number;
 	}
 	closedir(dir);
 
-	return total;
+	if (!ret) {
+		ret = malloc(sizeof(*ret));
+		assert(ret);
+	}
+	ret[n_files] = (uint64_t)-1;
+	qsort(ret, n_files, sizeof(*ret), cmpintp);
+	return ret;
 }
 
-/* Don't call this function directly, use ls_my_files() instead. */
-static uint64_t *__ls_my_files(const char *path,
-	uint64_t start_at, uint64_t end_at, uint64_t *pcount)
+/* Return true if the first sector of file @number tells @pfile_order. */
+static bool read_file_order(int dir_fd, uint64_t number,
+	unsigned int *pfile_order)
 {
-	uint64_t total_files = count_files(path, start_at, end_at);
-	DIR *dir;
-	struct dirent *entry;
-	uint64_t *ret, index;
+	char filename[MY_FILENAME_SIZE];
+	uint64_t buf[SECTOR_SIZE / sizeof(uint64_t)];
+	uint64_t found_offset, size;
+	ssize_t ret;
+	int fd;
+
+	fd = openat(dir_fd, filename_from_number(filename, number), O_RDONLY);
+	if (fd < 0)
+		return false;
+	ret = pread(fd, buf, sizeof(buf), 0);
+	close(fd);
+	if (ret != sizeof(buf))
+		return false;
 
+	/* The expected offset is not known yet, so validate the sector
+	 * again at the offset it records; only good sectors count.
+	 */
+	validate_buffer_with_block(buf, SECTOR_ORDER, 0, &found_offset, 0);
+	if (found_offset == 0 || found_offset % number != 0 ||
+			validate_buffer_with_block(buf, SECTOR_ORDER,
+				found_offset, &found_offset, 0) != bs_good)
+		return false;
+	size = found_offset / number;
+	if (!is_power_of_2(size) || ilog2(size) < MIN_FILE_ORDER ||
+			ilog2(size) > MAX_FILE_ORDER)
+		return false;
+	*pfile_order = ilog2(size);
+	return true;
+}
 
-	ret = malloc(sizeof(*ret) * (total_files + 1));
-	assert(ret);
+unsigned int get_file_order(int dir_fd, const uint64_t *files)
+{
+	unsigned int votes[MAX_FILE_ORDER - MIN_FILE_ORDER + 1] = {0};
+	unsigned int file_order, total_votes = 0, best = 0;
+	unsigned int i;
+
+	for (; *files != (uint64_t)-1; files++) {
+		/* The offset of 1.h2w is zero for any order. */
+		if (*files > 0 && read_file_order(dir_fd, *files, &file_order)) {
+			votes[file_order - MIN_FILE_ORDER]++;
+			total_votes++;
+		}
+	}
 
-	dir = opendir(path);
-	if (!dir)
-		err(errno, "Can't open path %s at %s()", path, __func__);
+	for (i = 1; i < sizeof(votes) / sizeof(votes[0]); i++)
+		if (votes[i] > votes[best])
+			best = i;
+	/* A fake drive that wraps around stores the sectors of a file
+	 * in another file; such a file tells a wrong order.
+	 */
+	if (votes[best] < 2 || votes[best] * 2 <= total_votes)
+		return DEFAULT_FILE_ORDER;
+	return MIN_FILE_ORDER + best;
+}
 
-	entry = readdir(dir);
-	index = 0;
-	while (entry) {
-		uint64_t number;
-		if (include_this_file(entry->d_name, start_at, end_at,
-				&number)) {
-			if (index >= total_files) {
-				/* The folder @path received more files
-				 * before we finished scanning it.
-				 */
-				closedir(dir);
-				free(ret);
-				return NULL;
+int preallocate_file(int fd, uint64_t size)
+{
+#if defined(FALLOC_FL_KEEP_SIZE)
+	return fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0 ? errno : 0;
+#elif __APPLE__ && __MACH__
+	fstore_t store = {
+		.fst_flags	= F_ALLOCATECONTIG | F_ALLOCATEALL,
+		.fst_posmode	= F_PEOFPOSMODE,
+		.fst_offset	= 0,
+		.fst_length	= size,
+	};
+	if (!fcntl(fd, F_PREALLOCATE, &store))
+		return 0;
+	/* There is no contiguous space that large. */
+	store.fst_flags = F_ALLOCATEALL;
+	return fcntl(fd, F_PREALLOCATE, &store) < 0 ? errno : 0;
+#else
+	UNUSED(fd);
+	UNUSED(size);
+	return ENOTSUP;
+#endif
+}
+
+int set_direct_io(int fd)
+{
+#if defined(O_DIRECT)
+	const int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) < 0)
+		return errno;
+	return 0;
+#elif __APPLE__ && __MACH__
+	return fcntl(fd, F_NOCACHE, 1) < 0 ? errno : 0;
+#else
+	UNUSED(fd);
+	return ENOTSUP;
+#endif
+}
+
+/* Number of extents fetched per call of FS_IOC_FIEMAP. */
+#define FIEMAP_EXTENTS	(32)
+
+int get_physical_offset(int fd, uint64_t pos, uint64_t len,
+	uint64_t *poffset)
+{
+#ifdef FS_IOC_FIEMAP
+	const uint64_t end = pos + len;
+	struct fiemap *fm = malloc(sizeof(*fm) +
+		FIEMAP_EXTENTS * sizeof(struct fiemap_extent));
+	uint64_t lowest = UINT64_MAX;
+	int rc = 0;
+
+	if (!fm)
+		return ENOMEM;
+	while (pos < end) {
+		unsigned int i;
+
+		memset(fm, 0, sizeof(*fm));
+		fm->fm_start = pos;
+		fm->fm_length = end - pos;
+		/* Files just written may not have their extents
+		 * allocated yet.
+		 */
+		fm->fm_flags = FIEMAP_FLAG_SYNC;
+		fm->fm_extent_count = FIEMAP_EXTENTS;
+		if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0) {
+			rc = errno;
+			break;
+		}
+		/* The rest of the range is a hole. */
+		if (fm->fm_mapped_extents == 0)
+			break;
+
+		for (i = 0; i < fm->fm_mapped_extents; i++) {
+			const struct fiemap_extent *fe = &fm->fm_extents[i];
+			uint64_t physical = fe->fe_physical;
+
+			if (fe->fe_flags & FIEMAP_EXTENT_UNKNOWN) {
+				rc = ENODATA;
+				goto out;
 			}
-			ret[index++] = number;
+			/* The first extent may start before @pos. */
+			if (fe->fe_logical < pos)
+				physical += pos - fe->fe_logical;
+			if (physical < lowest)
+				lowest = physical;
+			pos = fe->fe_logical + fe->fe_length;
+			if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+				pos = end;
 		}
+	}
+
+out:
+	free(fm);
+	if (!rc && lowest == UINT64_MAX)
+		rc = ENODATA;
+	if (!rc)
+		*poffset = lowest;
+	return rc;
+#else
+	UNUSED(fd);
+	UNUSED(pos);
+	UNUSED(len);
+	UNUSED(poffset);
+	return ENOTSUP;
+#endif
+}
 
-		entry = readdir(dir);
+int locate_file_system(const char *path, char *disk, size_t disk_size,
+	uint64_t *pstart_sector)
+{
+#ifdef __linux__
+	char sys_path[64], *real_path, *start_path;
+	struct stat st;
+	FILE *f;
+	int rc = 0;
+
+	if (stat(path, &st))
+		return errno;
+	snprintf(sys_path, sizeof(sys_path), "/sys/dev/block/%u:%u",
+		major(st.st_dev), minor(st.st_dev));
+	real_path = realpath(sys_path, NULL);
+	if (!real_path)
+		return errno;
+	start_path = malloc(strlen(real_path) + sizeof("/start"));
+	if (!start_path) {
+		free(real_path);
+		return ENOMEM;
 	}
-	closedir(dir);
+	sprintf(start_path, "%s/start", real_path);
+
+	/* Only partitions have a start; their disks are their parents. */
+	*pstart_sector = 0;
+	f = fopen(start_path, "r");
+	if (f) {
+		if (fscanf(f, "%" SCNu64, pstart_sector) != 1)
+			rc = EINVAL;
+		fclose(f);
+		*strrchr(real_path, '/') = '\0';
+	} else if (errno != ENOENT) {
+		rc = errno;
+	}
+	snprintf(disk, disk_size, "/dev/%s", strrchr(real_path, '/') + 1);
+
+	free(start_path);
+	free(real_path);
+	return rc;
+#else
+	UNUSED(path);
+	UNUSED(disk);
+	UNUSED(disk_size);
+	UNUSED(pstart_sector);
+	return ENOTSUP;
+#endif
+}
 
-	ret[index] = (uint64_t)-1;
-	*pcount = index;
-	return ret;
+void start_writeback(int fd, uint64_t offset, uint64_t len)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+	sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WRITE);
+#else
+	UNUSED(fd);
+	UNUSED(offset);
+	UNUSED(len);
+#endif
 }
 
-/* To be used with qsort(3). */
-static int cmpintp(const void *p1, const void *p2)
+int wait_writeback(int fd, uint64_t offset, uint64_t len)
 {
-	if (*(const uint64_t *)p1 < *(const uint64_t *)p2)
-		return -1;
-	return *(const uint64_t *)p1 > *(const uint64_t *)p2;
+#ifdef SYNC_FILE_RANGE_WRITE
+	if (!sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WAIT_BEFORE |
+			SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER))
+		return 0;
+	/* Not supported by this file descriptor. */
+	if (errno != EINVAL && errno != ESPIPE && errno != ENOSYS)
+		return errno;
+#else
+	UNUSED(offset);
+	UNUSED(len);
+#endif
+	return fdatasync(fd) < 0 ? errno : 0;
 }
 
-const uint64_t *ls_my_files(const char *path,
-	uint64_t start_at, uint64_t end_at)
+/* Carry out @req synchronously. */
+static void do_io_req(struct io_req *req)
 {
-	uint64_t *ret, my_count;
+	ssize_t rc;
+
+	if (req->op == IO_OP_FDATASYNC) {
+		if (fdatasync(req->fd) < 0)
+			req->err = errno;
+		return;
+	}
+
+	while (req->res < req->len) {
+		char *buf = req->buf + req->res;
+		const size_t len = req->len - req->res;
+		const off_t offset = req->offset + req->res;
+
+		rc = req->op == IO_OP_READ
+			? pread(req->fd, buf, len, offset)
+			: pwrite(req->fd, buf, len, offset);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			req->err = errno;
+			return;
+		}
+		if (rc == 0)
+			return;	/* End of file. */
+		req->res += rc;
+	}
+}
+
+/*
+ * Thread-pool engine
+ */
+
+struct pool_engine {
+	/* This must be the first field. See pool_engine() for details. */
+	struct io_engine	eng;
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+
+	/* Requests waiting for a thread, and finished requests.
+	 * Both are rings of queue_depth entries.
+	 */
+	struct io_req		**pending;
+	unsigned int		pending_head, n_pending;
+	struct io_req		**done;
+	unsigned int		done_head, n_done;
+
+	/* Number of requests being carried out by threads. */
+	unsigned int		n_running;
+	/* An fdatasync request is being carried out. */
+	bool			in_barrier;
+	bool			stop;
+
+	unsigned int		n_threads;
+	pthread_t		*threads;
+};
+
+static inline struct pool_engine *pool_engine(struct io_engine *eng)
+{
+	return (struct pool_engine *)eng;
+}
+
+static void *pool_thread(void *arg)
+{
+	struct pool_engine *pool = arg;
+	const unsigned int depth = pool->eng.queue_depth;
+
+	assert(!pthread_mutex_lock(&pool->lock));
+	while (true) {
+		struct io_req *req;
+
+		if (pool->stop)
+			break;
+		if (!pool->n_pending) {
+			assert(!pthread_cond_wait(&pool->cond, &pool->lock));
+			continue;
+		}
+		req = pool->pending[pool->pending_head];
+		/* Fdatasync requests are barriers. */
+		if (pool->in_barrier ||
+			(pool->n_running > 0 && req->op == IO_OP_FDATASYNC)) {
+			assert(!pthread_cond_wait(&pool->cond, &pool->lock));
+			continue;
+		}
+		if (req->op == IO_OP_FDATASYNC)
+			pool->in_barrier = true;
+		pool->pending_head = (pool->pending_head + 1) % depth;
+		pool->n_pending--;
+		pool->n_running++;
+		assert(!pthread_mutex_unlock(&pool->lock));
+
+		do_io_req(req);
+
+		assert(!pthread_mutex_lock(&pool->lock));
+		pool->n_running--;
+		if (req->op == IO_OP_FDATASYNC)
+			pool->in_barrier = false;
+		pool->done[(pool->done_head + pool->n_done) % depth] = req;
+		pool->n_done++;
+		assert(!pthread_cond_broadcast(&pool->cond));
+	}
+	assert(!pthread_mutex_unlock(&pool->lock));
+	return NULL;
+}
+
+static int pool_submit(struct io_engine *eng, struct io_req *req)
+{
+	struct pool_engine *pool = pool_engine(eng);
+	const unsigned int depth = eng->queue_depth;
+
+	assert(!pthread_mutex_lock(&pool->lock));
+	assert(pool->n_pending < depth);
+	pool->pending[(pool->pending_head + pool->n_pending) % depth] = req;
+	pool->n_pending++;
+	assert(!pthread_cond_broadcast(&pool->cond));
+	assert(!pthread_mutex_unlock(&pool->lock));
+	return 0;
+}
+
+static struct io_req *pool_wait(struct io_engine *eng)
+{
+	struct pool_engine *pool = pool_engine(eng);
+	struct io_req *req;
+
+	assert(!pthread_mutex_lock(&pool->lock));
+	while (!pool->n_done)
+		assert(!pthread_cond_wait(&pool->cond, &pool->lock));
+	req = pool->done[pool->done_head];
+	pool->done_head = (pool->done_head + 1) % eng->queue_depth;
+	pool->n_done--;
+	assert(!pthread_mutex_unlock(&pool->lock));
+	return req;
+}
+
+static void pool_free(struct io_engine *eng)
+{
+	struct pool_engine *pool = pool_engine(eng);
+	unsigned int i;
+
+	assert(!pthread_mutex_lock(&pool->lock));
+	pool->stop = true;
+	assert(!pthread_cond_broadcast(&pool->cond));
+	assert(!pthread_mutex_unlock(&pool->lock));
+	for (i = 0; i < pool->n_threads; i++)
+		assert(!pthread_join(pool->threads[i], NULL));
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool->done);
+	free(pool->pending);
+	free(pool);
+}
+
+static struct io_engine *create_pool_engine(unsigned int queue_depth)
+{
+	struct pool_engine *pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		goto error;
+
+	pool->pending = calloc(queue_depth, sizeof(*pool->pending));
+	pool->done = calloc(queue_depth, sizeof(*pool->done));
+	pool->threads = calloc(queue_depth, sizeof(*pool->threads));
+	if (!pool->pending || !pool->done || !pool->threads)
+		goto arrays;
+	if (pthread_mutex_init(&pool->lock, NULL))
+		goto arrays;
+	if (pthread_cond_init(&pool->cond, NULL))
+		goto lock;
+
+	pool->eng.name = "threads";
+	pool->eng.queue_depth = queue_depth;
+	pool->eng.in_flight = 0;
+	pool->eng.submit = pool_submit;
+	pool->eng.wait = pool_wait;
+	pool->eng.free = pool_free;
+
+	for (; pool->n_threads < queue_depth; pool->n_threads++) {
+		if (pthread_create(&pool->threads[pool->n_threads], NULL,
+				pool_thread, pool)) {
+			if (!pool->n_threads) {
+				pthread_cond_destroy(&pool->cond);
+				goto lock;
+			}
+			/* Fewer threads only reduce parallelism. */
+			break;
+		}
+	}
+	return &pool->eng;
+
+lock:
+	pthread_mutex_destroy(&pool->lock);
+arrays:
+	free(pool->threads);
+	free(pool->done);
+	free(pool->pending);
+	free(pool);
+error:
+	return NULL;
+}
+
+#ifdef HAVE_IO_URING
+
+/*
+ * io_uring engine
+ */
+
+struct uring_engine {
+	/* This must be the first field. See uring_engine() for details. */
+	struct io_engine	eng;
+
+	int			ring_fd;
+	bool			has_fixed_bufs;
+
+	/* Submission queue. */
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	struct io_uring_sqe	*sqes;
+
+	/* Completion queue. */
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	/* Number of requests in the kernel. */
+	unsigned int		n_running;
+	/* Requests that finished before a barrier was submitted, and
+	 * that uring_wait() has not returned yet.
+	 */
+	struct io_req		**done;
+	unsigned int		done_head;
+	unsigned int		n_done;
+
+	/* Mappings of the rings. */
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	size_t			sqes_size;
+};
+
+static inline struct uring_engine *uring_engine(struct io_engine *eng)
+{
+	return (struct uring_engine *)eng;
+}
+
+static int uring_enter(int ring_fd, unsigned int to_submit,
+	unsigned int min_complete, unsigned int flags)
+{
+	int rc;
 
 	do {
-		ret = __ls_my_files(path, start_at, end_at, &my_count);
-	} while (!ret);
+		rc = syscall(__NR_io_uring_enter, ring_fd, to_submit,
+			min_complete, flags, NULL, 0);
+	} while (rc < 0 && errno == EINTR);
+	return rc < 0 ? errno : 0;
+}
 
-	qsort(ret, my_count, sizeof(*ret), cmpintp);
-	return ret;
+/* Queue the part of @req that has not been transferred yet. */
+static int uring_queue(struct uring_engine *ue, struct io_req *req)
+{
+	const unsigned int tail = *ue->sq_tail;
+	const unsigned int index = tail & *ue->sq_mask;
+	struct io_uring_sqe *sqe = &ue->sqes[index];
+	const bool fixed = ue->has_fixed_bufs && req->buf_index >= 0;
+	int rc;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = req->fd;
+	sqe->user_data = (uintptr_t)req;
+	switch (req->op) {
+	case IO_OP_READ:
+		sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+		break;
+	case IO_OP_WRITE:
+		sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+		break;
+	case IO_OP_FDATASYNC:
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		sqe->flags = IOSQE_IO_DRAIN;
+		break;
+	default:
+		assert(0);
+	}
+	if (req->op != IO_OP_FDATASYNC) {
+		const size_t len = req->len - req->res;
+		assert(len <= UINT32_MAX);
+		sqe->addr = (uintptr_t)(req->buf + req->res);
+		sqe->len = len;
+		sqe->off = req->offset + req->res;
+		if (fixed)
+			sqe->buf_index = req->buf_index;
+	}
+
+	ue->sq_array[index] = index;
+	/* Publish the entry before the new tail. */
+	__atomic_store_n(ue->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	rc = uring_enter(ue->ring_fd, 1, 0, 0);
+
+	/* Once the kernel takes the entry, its completion reports
+	 * any failure.
+	 */
+	if (__atomic_load_n(ue->sq_head, __ATOMIC_ACQUIRE) != tail)
+		return 0;
+	/* Take the entry back; otherwise, the next submission would
+	 * submit it along with a request the caller has already freed.
+	 */
+	__atomic_store_n(ue->sq_tail, tail, __ATOMIC_RELEASE);
+	return rc ? rc : EAGAIN;
+}
+
+/* Wait for a completion and return its request if the request finished;
+ * return NULL if the rest of the request was queued again.
+ */
+static struct io_req *uring_reap(struct uring_engine *ue)
+{
+	const unsigned int head = *ue->cq_head;
+	struct io_uring_cqe *cqe;
+	struct io_req *req;
+	int res, rc;
+
+	assert(ue->n_running > 0);
+	while (head == __atomic_load_n(ue->cq_tail, __ATOMIC_ACQUIRE)) {
+		rc = uring_enter(ue->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+		if (rc)
+			err(rc, "Can't wait for I/O at %s()", __func__);
+	}
+
+	cqe = &ue->cqes[head & *ue->cq_mask];
+	req = (struct io_req *)(uintptr_t)cqe->user_data;
+	res = cqe->res;
+	/* Release the entry to the kernel. */
+	__atomic_store_n(ue->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	if (res < 0) {
+		if (res == -EINTR || res == -EAGAIN)
+			goto requeue;
+		req->err = -res;
+		goto finished;
+	}
+	if (req->op == IO_OP_FDATASYNC || res == 0)
+		goto finished;
+	req->res += res;
+	if (req->res == req->len)
+		goto finished;
+
+requeue:
+	/* Short transfer; queue the rest. */
+	rc = uring_queue(ue, req);
+	if (!rc)
+		return NULL;
+	req->err = rc;
+finished:
+	ue->n_running--;
+	return req;
+}
+
+static int uring_submit(struct io_engine *eng, struct io_req *req)
+{
+	struct uring_engine *ue = uring_engine(eng);
+	int rc;
+
+	/* The rest of a short transfer is queued after the barrier,
+	 * so the barrier would not cover it. Thus, the requests before
+	 * a barrier finish before the barrier is queued.
+	 */
+	if (req->op == IO_OP_FDATASYNC) {
+		while (ue->n_running > 0) {
+			struct io_req *done = uring_reap(ue);
+			if (!done)
+				continue;
+			assert(ue->n_done < eng->queue_depth);
+			ue->done[(ue->done_head + ue->n_done) %
+				eng->queue_depth] = done;
+			ue->n_done++;
+		}
+	}
+
+	rc = uring_queue(ue, req);
+	if (!rc)
+		ue->n_running++;
+	return rc;
+}
+
+static struct io_req *uring_wait(struct io_engine *eng)
+{
+	struct uring_engine *ue = uring_engine(eng);
+	struct io_req *req;
+
+	if (ue->n_done > 0) {
+		req = ue->done[ue->done_head];
+		ue->done_head = (ue->done_head + 1) % eng->queue_depth;
+		ue->n_done--;
+		return req;
+	}
+
+	do {
+		req = uring_reap(ue);
+	} while (!req);
+	return req;
+}
+
+static void uring_free(struct io_engine *eng)
+{
+	struct uring_engine *ue = uring_engine(eng);
+
+	munmap(ue->sqes, ue->sqes_size);
+	if (ue->cq_ring != ue->sq_ring)
+		munmap(ue->cq_ring, ue->cq_ring_size);
+	munmap(ue->sq_ring, ue->sq_ring_size);
+	close(ue->ring_fd);
+	free(ue->done);
+	free(ue);
+}
+
+static struct io_engine *create_uring_engine(unsigned int queue_depth,
+	char * const *bufs, unsigned int n_bufs, size_t buf_size)
+{
+	struct uring_engine *ue;
+	struct io_uring_params p;
+	unsigned int i;
+
+	ue = malloc(sizeof(*ue));
+	if (!ue)
+		goto error;
+	ue->done = calloc(queue_depth, sizeof(*ue->done));
+	if (!ue->done)
+		goto ue;
+	ue->n_running = 0;
+	ue->done_head = 0;
+	ue->n_done = 0;
+
+	memset(&p, 0, sizeof(p));
+	ue->ring_fd = syscall(__NR_io_uring_setup, queue_depth, &p);
+	if (ue->ring_fd < 0)
+		goto ue;
+	/* IORING_OP_READ and IORING_OP_WRITE came with this feature. */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS))
+		goto ring_fd;
+
+	ue->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ue->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ue->cq_ring_size > ue->sq_ring_size)
+			ue->sq_ring_size = ue->cq_ring_size;
+		ue->cq_ring_size = ue->sq_ring_size;
+	}
+	ue->sq_ring = mmap(NULL, ue->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ue->ring_fd, IORING_OFF_SQ_RING);
+	if (ue->sq_ring == MAP_FAILED)
+		goto ring_fd;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ue->cq_ring = ue->sq_ring;
+	} else {
+		ue->cq_ring = mmap(NULL, ue->cq_ring_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ue->ring_fd, IORING_OFF_CQ_RING);
+		if (ue->cq_ring == MAP_FAILED)
+			goto sq_ring;
+	}
+	ue->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ue->sqes = mmap(NULL, ue->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ue->ring_fd, IORING_OFF_SQES);
+	if (ue->sqes == MAP_FAILED)
+		goto cq_ring;
+
+	ue->sq_head = (unsigned int *)((char *)ue->sq_ring + p.sq_off.head);
+	ue->sq_tail = (unsigned int *)((char *)ue->sq_ring + p.sq_off.tail);
+	ue->sq_mask = (unsigned int *)((char *)ue->sq_ring +
+		p.sq_off.ring_mask);
+	ue->sq_array = (unsigned int *)((char *)ue->sq_ring + p.sq_off.array);
+	ue->cq_head = (unsigned int *)((char *)ue->cq_ring + p.cq_off.head);
+	ue->cq_tail = (unsigned int *)((char *)ue->cq_ring + p.cq_off.tail);
+	ue->cq_mask = (unsigned int *)((char *)ue->cq_ring +
+		p.cq_off.ring_mask);
+	ue->cqes = (struct io_uring_cqe *)((char *)ue->cq_ring +
+		p.cq_off.cqes);
+
+	/* Registering buffers is optional; it fails, for example,
+	 * when the buffers exceed the limit of locked memory.
+	 */
+	ue->has_fixed_bufs = false;
+	if (n_bufs > 0) {
+		struct iovec *iov = calloc(n_bufs, sizeof(*iov));
+		if (iov) {
+			for (i = 0; i < n_bufs; i++) {
+				iov[i].iov_base = bufs[i];
+				iov[i].iov_len = buf_size;
+			}
+			ue->has_fixed_bufs = !syscall(__NR_io_uring_register,
+				ue->ring_fd, IORING_REGISTER_BUFFERS,
+				iov, n_bufs);
+			free(iov);
+		}
+	}
+
+	ue->eng.name = "io_uring";
+	ue->eng.queue_depth = queue_depth;
+	ue->eng.in_flight = 0;
+	ue->eng.submit = uring_submit;
+	ue->eng.wait = uring_wait;
+	ue->eng.free = uring_free;
+	return &ue->eng;
+
+cq_ring:
+	if (ue->cq_ring != ue->sq_ring)
+		munmap(ue->cq_ring, ue->cq_ring_size);
+sq_ring:
+	munmap(ue->sq_ring, ue->sq_ring_size);
+ring_fd:
+	close(ue->ring_fd);
+ue:
+	free(ue->done);
+	free(ue);
+error:
+	return NULL;
+}
+
+#endif	/* HAVE_IO_URING */
+
+struct io_engine *create_io_engine(unsigned int queue_depth,
+	char * const *bufs, unsigned int n_bufs, size_t buf_size)
+{
+	assert(queue_depth > 0);
+
+#ifdef HAVE_IO_URING
+	struct io_engine *eng = create_uring_engine(queue_depth,
+		bufs, n_bufs, buf_size);
+	if (eng)
+		return eng;
+#else
+	UNUSED(bufs);
+	UNUSED(n_bufs);
+	UNUSED(buf_size);
+#endif
+
+	return create_pool_engine(queue_depth);
 }
 
 #if __APPLE__ && __MACH__
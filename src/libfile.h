@@ -2,6 +2,9 @@
 #define HEADER_LIBFILE_H
 
 #include <stdint.h>	/* For type uint64_t. */
+#include <stdbool.h>
+#include <stddef.h>	/* For type size_t.	*/
+#include <assert.h>
 
 void adjust_dev_path(const char **dev_path);
 
@@ -11,12 +14,187 @@ uint64_t get_free_blocks(const char *path);
 /* Return true if @filename matches the regex /^[0-9]+\.h2w$/ */
 int is_my_file(const char *filename);
 
-/* Caller must free(3) the returned pointer. */
-char *full_fn_from_number(const char **filename, const char *path,
-	uint64_t num);
+/* Size of a buffer that holds the name of any .h2w file. */
+#define MY_FILENAME_SIZE	(32)
 
-const uint64_t *ls_my_files(const char *path,
-	uint64_t start_at, uint64_t end_at);
+/* Write the name of file @num into @filename, a buffer of
+ * MY_FILENAME_SIZE bytes, and return @filename.
+ */
+char *filename_from_number(char *filename, uint64_t num);
+
+/* Open the directory @path, so its files are reached with openat(2) and
+ * fstatat(2) without building their paths. Exit on failure.
+ */
+int open_dir(const char *path);
+
+/* Return the sorted numbers of the .h2w files in the directory @dir_fd
+ * from @start_at to @end_at, ending with (uint64_t)-1.
+ * Caller must free(3) the returned pointer.
+ */
+const uint64_t *ls_my_files(int dir_fd, uint64_t start_at, uint64_t end_at);
+
+/* The size of .h2w files is 2^file_order bytes, and
+ * file NUM.h2w holds the data of the offset (NUM - 1) << file_order.
+ */
+#define MIN_FILE_ORDER		(26)	/* 64MB */
+#define MAX_FILE_ORDER		(36)	/* 64GB */
+#define DEFAULT_FILE_ORDER	(30)	/* 1GB	*/
+
+/* Every sector of a .h2w file records its offset, so the order of
+ * the files in @files, a list as returned by ls_my_files(), is derived
+ * from the first sectors of the files other than 1.h2w.
+ * Only good sectors count, and at least two files, more than half of
+ * those that tell an order, must agree on the order.
+ * Return DEFAULT_FILE_ORDER otherwise.
+ */
+unsigned int get_file_order(int dir_fd, const uint64_t *files);
+
+/* Reserve the first @size bytes of @fd on the drive without changing
+ * the size of the file, so the file system can allocate contiguous
+ * extents for the file, and update its metadata only once.
+ * Return zero on success or an errno value; for example, ENOTSUP when
+ * the file system or the operating system does not support it.
+ */
+int preallocate_file(int fd, uint64_t size);
+
+/* Make I/O on @fd bypass the page cache. The buffers, offsets, and
+ * lengths of the I/O must then be aligned to the block size of
+ * the file system.
+ * Return zero on success or an errno value; for example, EINVAL when
+ * the file system does not support direct I/O.
+ */
+int set_direct_io(int fd);
+
+/* Store in *@poffset the lowest offset in bytes on the drive of
+ * the bytes [@pos, @pos + @len) of @fd.
+ * Return zero on success or an errno value; for example, ENOTSUP when
+ * the file system or the operating system can't tell.
+ */
+int get_physical_offset(int fd, uint64_t pos, uint64_t len,
+	uint64_t *poffset);
+
+/* Store in @disk, a buffer of @disk_size bytes, the path of the disk
+ * that holds the file system of @path, and in *@pstart_sector the
+ * sector of the disk, in 512-byte sectors, where the file system starts.
+ * Return zero on success or an errno value; for example, ENOTSUP when
+ * the operating system can't tell.
+ */
+int locate_file_system(const char *path, char *disk, size_t disk_size,
+	uint64_t *pstart_sector);
+
+/* Start writing back to the drive the dirty pages of @fd in the range
+ * [@offset, @offset + @len), but do not wait for it. This is only a hint;
+ * it does nothing where unsupported.
+ */
+void start_writeback(int fd, uint64_t offset, uint64_t len);
+
+/* Write back the range [@offset, @offset + @len) of @fd, and wait for it.
+ * Contrary to fdatasync(2), this function does not flush the metadata of
+ * the file and the cache of the drive, so it does not replace a barrier.
+ * Where unsupported, it calls fdatasync(2).
+ * Return zero on success or an errno value.
+ */
+int wait_writeback(int fd, uint64_t offset, uint64_t len);
+
+/*
+ *	Asynchronous I/O
+ */
+
+enum io_op {
+	IO_OP_READ,
+	IO_OP_WRITE,
+	/* Start after all requests submitted before it finish,
+	 * and finish before requests submitted after it start.
+	 */
+	IO_OP_FDATASYNC,
+};
+
+struct io_req {
+	enum io_op	op;
+	int		fd;
+	char		*buf;
+	size_t		len;
+	uint64_t	offset;
+	/* Index of @buf in the buffers passed to create_io_engine(),
+	 * or -1 if @buf is not one of them.
+	 */
+	int		buf_index;
+	/* Opaque for the engine. */
+	void		*data;
+
+	/* Set when the request finishes. */
+
+	/* Number of bytes transferred; reads stop early at end of file. */
+	size_t		res;
+	/* Zero or the errno value of the failure. */
+	int		err;
+};
+
+#define IO_MAX_QUEUE_DEPTH	(64)
+
+struct io_engine {
+	const char	*name;
+	unsigned int	queue_depth;
+	/* Number of requests submitted and not yet returned by io_wait(). */
+	unsigned int	in_flight;
+
+	/* Methods. */
+	int (*submit)(struct io_engine *eng, struct io_req *req);
+	struct io_req *(*wait)(struct io_engine *eng);
+	void (*free)(struct io_engine *eng);
+};
+
+/* Return an engine that keeps up to @queue_depth requests in flight.
+ * The engine uses io_uring where available, and a pool of threads
+ * otherwise. If the engine supports it, the @n_bufs buffers of @bufs,
+ * each of @buf_size bytes, are registered with the kernel to speed up
+ * requests that use them.
+ * Return NULL on failure.
+ */
+struct io_engine *create_io_engine(unsigned int queue_depth,
+	char * const *bufs, unsigned int n_bufs, size_t buf_size);
+
+static inline bool io_is_full(const struct io_engine *eng)
+{
+	return eng->in_flight >= eng->queue_depth;
+}
+
+/* Queue @req; the caller must not submit when io_is_full() is true.
+ * Return zero on success or an errno value.
+ */
+static inline int io_submit(struct io_engine *eng, struct io_req *req)
+{
+	int rc;
+
+	assert(!io_is_full(eng));
+	req->res = 0;
+	req->err = 0;
+	rc = eng->submit(eng, req);
+	if (!rc)
+		eng->in_flight++;
+	return rc;
+}
+
+/* Wait for a request to finish and return it;
+ * return NULL if no request is in flight.
+ */
+static inline struct io_req *io_wait(struct io_engine *eng)
+{
+	struct io_req *req;
+
+	if (!eng->in_flight)
+		return NULL;
+	req = eng->wait(eng);
+	assert(req);
+	eng->in_flight--;
+	return req;
+}
+
+static inline void free_io_engine(struct io_engine *eng)
+{
+	assert(!eng->in_flight);
+	eng->free(eng);
+}
 
 #if __APPLE__ && __MACH__
 
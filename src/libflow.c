@@ -483,6 +483,17 @@ void end_measurement(struct flow *fw)
 	clear_progress(fw); /* Erase progress information. */
 }
 
+void add_measurement(struct flow *fw, uint64_t blocks, uint64_t time_ns)
+{
+	assert(fw->processed_blocks == 0);
+	fw->measured_blocks += blocks;
+	fw->measured_time_ns += time_ns;
+	if (time_ns > 0) {
+		report_progress(fw,
+			calc_avg_speed(fw->block_order, blocks, time_ns));
+	}
+}
+
 void print_avg_seq_speed(const struct flow *fw, const char *speed_type,
 	bool use_sectors)
 {
@@ -505,6 +516,77 @@ void print_avg_seq_speed(const struct flow *fw, const char *speed_type,
 		time_ns, block_order);
 }
 
+void init_pacer(struct pacer *pc, uint64_t max_rate, uint64_t max_iops,
+	uint64_t burst_ns)
+{
+	struct timespec now;
+
+	assert(!pthread_mutex_init(&pc->lock, NULL));
+	pc->ns_per_byte = max_rate == FW_MAX_PROCESS_RATE_NONE ? 0
+		: 1000000000.0 / (max_rate << KILOBYTE_ORDER);
+	pc->ns_per_op = max_iops == PC_MAX_IOPS_NONE ? 0
+		: 1000000000ULL / max_iops;
+	pc->burst_ns = burst_ns;
+
+	/* The bucket starts empty; otherwise, the first chunks of a flow
+	 * would go through for free, and the flow would settle on
+	 * the size of these tiny chunks because they seem the fastest.
+	 */
+	assert(!clock_gettime(CLOCK_MONOTONIC, &now));
+	pc->bytes_paid_ns = now.tv_sec * 1000000000ULL + now.tv_nsec +
+		burst_ns;
+	pc->ops_paid_ns = pc->bytes_paid_ns;
+}
+
+void free_pacer(struct pacer *pc)
+{
+	pthread_mutex_destroy(&pc->lock);
+}
+
+/* Add @cost_ns to the debt paid off at *@ppaid_ns, and return how long
+ * to wait for the debt before the new one to fall within a burst.
+ */
+static uint64_t spend(uint64_t *ppaid_ns, uint64_t now_ns, uint64_t cost_ns,
+	uint64_t burst_ns)
+{
+	uint64_t wait_ns;
+
+	/* Idle time does not pay for future I/O beyond a burst. */
+	if (*ppaid_ns < now_ns)
+		*ppaid_ns = now_ns;
+	wait_ns = *ppaid_ns > now_ns + burst_ns
+		? *ppaid_ns - now_ns - burst_ns : 0;
+	*ppaid_ns += cost_ns;
+	return wait_ns;
+}
+
+void pace(struct pacer *pc, uint64_t bytes)
+{
+	struct timespec now;
+	uint64_t now_ns, wait_ns, ops_wait_ns;
+
+	if (!pc_is_limited(pc))
+		return;
+
+	assert(!clock_gettime(CLOCK_MONOTONIC, &now));
+	now_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	/* Threads reserve their I/O in turns, and then wait outside
+	 * the lock, so each thread waits for the I/O reserved before it.
+	 */
+	assert(!pthread_mutex_lock(&pc->lock));
+	wait_ns = spend(&pc->bytes_paid_ns, now_ns,
+		round(bytes * pc->ns_per_byte), pc->burst_ns);
+	ops_wait_ns = spend(&pc->ops_paid_ns, now_ns, pc->ns_per_op,
+		pc->burst_ns);
+	assert(!pthread_mutex_unlock(&pc->lock));
+
+	if (ops_wait_ns > wait_ns)
+		wait_ns = ops_wait_ns;
+	if (wait_ns > 0)
+		nssleep(wait_ns);
+}
+
 static inline void __dbuf_free(struct dynamic_buffer *dbuf)
 {
 	if (dbuf->buf != dbuf->backup_buf)
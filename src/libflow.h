@@ -7,6 +7,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "libutils.h"
 
@@ -117,6 +118,14 @@ static inline void fw_get_measurements(const struct flow *fw,
 	*time_ns = fw->measured_time_ns + fw->acc_delay_ns;
 }
 
+/* Account for @blocks that a previous run processed in @time_ns. */
+static inline void fw_resume_measurements(struct flow *fw,
+	uint64_t blocks, uint64_t time_ns)
+{
+	fw->measured_blocks += blocks;
+	fw->measured_time_ns += time_ns;
+}
+
 uint64_t get_rem_chunk_blocks(const struct flow *fw);
 
 struct fw_measurement {
@@ -131,9 +140,54 @@ void measure(struct flow *fw, uint64_t processed_blocks,
 void clear_progress(struct flow *fw);
 void end_measurement(struct flow *fw);
 
+/* Account for @blocks that other flows processed in the last @time_ns,
+ * and report progress. This way, a flow reports the aggregated progress
+ * of flows that run concurrently; such a flow does not process blocks.
+ */
+void add_measurement(struct flow *fw, uint64_t blocks, uint64_t time_ns);
+
 void print_avg_seq_speed(const struct flow *fw, const char *speed_type,
 	bool use_sectors);
 
+/*
+ * A pacer is a token bucket that limits I/O to a maximum rate of bytes
+ * and of operations per second. Callers call pace() before each I/O,
+ * and several threads can share a pacer. Contrary to the maximum
+ * processing rate of a flow, which stops the flow once per measurement,
+ * a pacer spreads the waits over the I/O; the I/O only runs ahead of
+ * the rates for bursts of up to @burst_ns.
+ */
+struct pacer {
+	pthread_mutex_t	lock;
+	/* Time that a byte and an operation cost; zero for no limit. */
+	double		ns_per_byte;
+	uint64_t	ns_per_op;
+	uint64_t	burst_ns;
+	/* When the bytes and the operations paced so far are paid off,
+	 * on the monotonic clock.
+	 */
+	uint64_t	bytes_paid_ns;
+	uint64_t	ops_paid_ns;
+};
+
+#define PC_MAX_IOPS_NONE	(0)
+
+/* The unit of @max_rate is KB per second, as in init_flow().
+ * @max_rate can be FW_MAX_PROCESS_RATE_NONE, and @max_iops can be
+ * PC_MAX_IOPS_NONE.
+ */
+void init_pacer(struct pacer *pc, uint64_t max_rate, uint64_t max_iops,
+	uint64_t burst_ns);
+void free_pacer(struct pacer *pc);
+
+static inline bool pc_is_limited(const struct pacer *pc)
+{
+	return pc->ns_per_byte > 0 || pc->ns_per_op > 0;
+}
+
+/* Wait until an I/O of @bytes fits in the rates of @pc. */
+void pace(struct pacer *pc, uint64_t bytes);
+
 struct dynamic_buffer {
 	char   *buf;
 	size_t len;
@@ -0,0 +1,100 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libjournal.h"
+
+int journal_init(struct journal *j, const char *filename)
+{
+	const char *slash = strrchr(filename, '/');
+	const char *name = slash ? slash + 1 : filename;
+	char *dir;
+	size_t len;
+
+	if (!*name)
+		return EISDIR;
+
+	/* The root directory is the only one whose name ends in a slash. */
+	dir = slash ? strndup(filename, slash > filename ? slash - filename : 1)
+		: strdup(".");
+	if (!dir)
+		return ENOMEM;
+	j->dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+	free(dir);
+	if (j->dir_fd < 0)
+		return errno;
+
+	len = strlen(name) + sizeof(".tmp");
+	j->name = strdup(name);
+	j->tmp_name = malloc(len);
+	if (!j->name || !j->tmp_name) {
+		journal_free(j);
+		return ENOMEM;
+	}
+	snprintf(j->tmp_name, len, "%s.tmp", name);
+	return 0;
+}
+
+void journal_free(struct journal *j)
+{
+	close(j->dir_fd);
+	free(j->name);
+	free(j->tmp_name);
+	j->dir_fd = -1;
+	j->name = NULL;
+	j->tmp_name = NULL;
+}
+
+FILE *journal_open(const struct journal *j)
+{
+	FILE *f;
+	int fd = openat(j->dir_fd, j->name, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	f = fdopen(fd, "r");
+	if (!f) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+	}
+	return f;
+}
+
+FILE *journal_start(struct journal *j)
+{
+	FILE *f;
+	int fd = openat(j->dir_fd, j->tmp_name, O_WRONLY | O_CREAT | O_TRUNC,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0)
+		return NULL;
+	f = fdopen(fd, "w");
+	if (!f) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+	}
+	return f;
+}
+
+int journal_commit(struct journal *j, FILE *f)
+{
+	int rc = 0;
+
+	/* The content must reach the host drive before the rename. */
+	if (fflush(f) || fsync(fileno(f)))
+		rc = errno;
+	if (fclose(f) && !rc)
+		rc = errno;
+	if (rc)
+		return rc;
+
+	if (renameat(j->dir_fd, j->tmp_name, j->dir_fd, j->name))
+		return errno;
+	/* Make the rename durable. */
+	return fsync(j->dir_fd) ? errno : 0;
+}
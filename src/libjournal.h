@@ -0,0 +1,45 @@
+#ifndef HEADER_LIBJOURNAL_H
+#define HEADER_LIBJOURNAL_H
+
+#include <stdio.h>
+
+/*
+ * A journal is a small text file on the host, outside the drive under test,
+ * that records the progress of a run, so an interrupted run can resume.
+ *
+ * Since f3write and f3read change their root directory to the drive,
+ * the directory of the journal is opened beforehand, and all accesses go
+ * through it. Every new version of the journal replaces the previous one
+ * atomically, so a power failure leaves one of them intact.
+ */
+
+struct journal {
+	/* Directory of the journal. */
+	int	dir_fd;
+	char	*name;
+	/* Name of the next version while it is written. */
+	char	*tmp_name;
+};
+
+/* Return zero on success or an errno value. */
+int journal_init(struct journal *j, const char *filename);
+void journal_free(struct journal *j);
+
+/* Return the current version of the journal for reading, or NULL with
+ * errno set; errno is ENOENT when there is no journal.
+ * The caller must fclose(3) the returned stream.
+ */
+FILE *journal_open(const struct journal *j);
+
+/* Return a stream for writing the next version of the journal, or NULL
+ * with errno set. The next version only replaces the current one
+ * once journal_commit() is called.
+ */
+FILE *journal_start(struct journal *j);
+
+/* Close @f, and make it the current version of the journal.
+ * Return zero on success or an errno value.
+ */
+int journal_commit(struct journal *j, FILE *f);
+
+#endif	/* HEADER_LIBJOURNAL_H */
@@ -0,0 +1,195 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libpipe.h"
+
+unsigned int pl_get_n_workers(unsigned int max_workers)
+{
+	const long n_cpus = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	if (n_cpus < 1)
+		return 1;
+	if ((unsigned long)n_cpus > max_workers)
+		return max_workers;
+	return n_cpus;
+}
+
+int pl_init(struct pipeline *pl, unsigned int n_slots, size_t slot_size,
+	unsigned int align_order)
+{
+	const size_t alignment = 1ULL << align_order;
+	unsigned int i;
+	int rc;
+
+	assert(n_slots > 0);
+	assert(slot_size >= alignment && slot_size % alignment == 0);
+
+	pl->slots = calloc(n_slots, sizeof(*pl->slots));
+	if (!pl->slots)
+		return ENOMEM;
+	pl->n_slots = n_slots;
+
+	/* Find the largest buffers that fit in memory. */
+	for (;;) {
+		for (i = 0; i < n_slots; i++) {
+			pl->slots[i].buf = aligned_alloc(alignment, slot_size);
+			if (!pl->slots[i].buf)
+				break;
+		}
+		if (i == n_slots)
+			break;
+
+		while (i > 0)
+			free(pl->slots[--i].buf);
+		if (slot_size == alignment) {
+			rc = ENOMEM;
+			goto slots;
+		}
+		slot_size /= 2;
+	}
+	pl->slot_size = slot_size;
+
+	rc = pthread_mutex_init(&pl->lock, NULL);
+	if (rc)
+		goto bufs;
+	rc = pthread_cond_init(&pl->cond, NULL);
+	if (rc)
+		goto lock;
+
+	pl_start(pl, 0);
+	return 0;
+
+lock:
+	pthread_mutex_destroy(&pl->lock);
+bufs:
+	for (i = 0; i < n_slots; i++)
+		free(pl->slots[i].buf);
+slots:
+	free(pl->slots);
+	return rc;
+}
+
+void pl_free(struct pipeline *pl)
+{
+	unsigned int i;
+
+	pthread_cond_destroy(&pl->cond);
+	pthread_mutex_destroy(&pl->lock);
+	for (i = 0; i < pl->n_slots; i++)
+		free(pl->slots[i].buf);
+	free(pl->slots);
+	pl->slots = NULL;
+	pl->n_slots = 0;
+}
+
+void pl_start(struct pipeline *pl, uint64_t n_items)
+{
+	unsigned int i;
+
+	for (i = 0; i < pl->n_slots; i++) {
+		pl->slots[i].len = 0;
+		pl->slots[i].state = PL_FREE;
+	}
+	pl->next_produce = 0;
+	pl->next_consume = 0;
+	pl->n_items = n_items;
+	pl->stopped = false;
+}
+
+static inline struct pl_slot *seq_to_slot(struct pipeline *pl, uint64_t seq)
+{
+	return &pl->slots[seq % pl->n_slots];
+}
+
+/* Wait until the slot of *@pnext_seq is in state @from, move it to
+ * state @to, and advance *@pnext_seq.
+ */
+static struct pl_slot *take_slot(struct pipeline *pl, uint64_t *pnext_seq,
+	enum pl_slot_state from, enum pl_slot_state to)
+{
+	struct pl_slot *slot = NULL;
+
+	assert(!pthread_mutex_lock(&pl->lock));
+	while (!pl->stopped && *pnext_seq < pl->n_items) {
+		struct pl_slot *next = seq_to_slot(pl, *pnext_seq);
+		if (next->state == from) {
+			slot = next;
+			slot->state = to;
+			slot->seq = (*pnext_seq)++;
+			break;
+		}
+		assert(!pthread_cond_wait(&pl->cond, &pl->lock));
+	}
+	assert(!pthread_mutex_unlock(&pl->lock));
+	return slot;
+}
+
+static void set_state(struct pipeline *pl, struct pl_slot *slot,
+	enum pl_slot_state state)
+{
+	assert(!pthread_mutex_lock(&pl->lock));
+	slot->state = state;
+	assert(!pthread_cond_broadcast(&pl->cond));
+	assert(!pthread_mutex_unlock(&pl->lock));
+}
+
+struct pl_slot *pl_get_free(struct pipeline *pl)
+{
+	struct pl_slot *slot = take_slot(pl, &pl->next_produce,
+		PL_FREE, PL_FILLING);
+	if (slot)
+		slot->len = 0;
+	return slot;
+}
+
+struct pl_slot *pl_get_full(struct pipeline *pl)
+{
+	return take_slot(pl, &pl->next_consume, PL_FULL, PL_DRAINING);
+}
+
+void pl_put_full(struct pipeline *pl, struct pl_slot *slot)
+{
+	assert(slot->state == PL_FILLING);
+	assert(slot->len <= pl->slot_size);
+	set_state(pl, slot, PL_FULL);
+}
+
+void pl_put_free(struct pipeline *pl, struct pl_slot *slot)
+{
+	assert(slot->state == PL_DRAINING);
+	set_state(pl, slot, PL_FREE);
+}
+
+void pl_wait_drained(struct pipeline *pl)
+{
+	unsigned int i = 0;
+
+	assert(!pthread_mutex_lock(&pl->lock));
+	while (!pl->stopped && i < pl->n_slots) {
+		if (pl->slots[i].state == PL_FREE) {
+			i++;
+			continue;
+		}
+		assert(!pthread_cond_wait(&pl->cond, &pl->lock));
+	}
+	assert(!pthread_mutex_unlock(&pl->lock));
+}
+
+void pl_close(struct pipeline *pl)
+{
+	assert(!pthread_mutex_lock(&pl->lock));
+	pl->n_items = pl->next_produce;
+	assert(!pthread_cond_broadcast(&pl->cond));
+	assert(!pthread_mutex_unlock(&pl->lock));
+}
+
+void pl_stop(struct pipeline *pl)
+{
+	assert(!pthread_mutex_lock(&pl->lock));
+	pl->stopped = true;
+	assert(!pthread_cond_broadcast(&pl->cond));
+	assert(!pthread_mutex_unlock(&pl->lock));
+}
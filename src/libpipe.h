@@ -0,0 +1,136 @@
+#ifndef HEADER_LIBPIPE_H
+#define HEADER_LIBPIPE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * A pipeline is a ring of buffers, called slots, that producer threads
+ * fill and consumer threads drain. Producers take slots in order, and
+ * consumers receive slots in the same order; so, for example, data
+ * generated by several threads can be written to a file sequentially.
+ *
+ * The life of a slot is:
+ *	pl_get_free() -> fill it -> pl_put_full() ->
+ *	pl_get_full() -> drain it -> pl_put_free()
+ */
+
+enum pl_slot_state {
+	PL_FREE,
+	PL_FILLING,
+	PL_FULL,
+	PL_DRAINING,
+};
+
+struct pl_slot {
+	char			*buf;
+	/* Number of bytes of @buf in use; set by producers. */
+	size_t			len;
+	/* Sequence number of the slot since pl_start(). */
+	uint64_t		seq;
+	/* Where the data of @buf belongs; set by producers. */
+	uint64_t		offset;
+	enum pl_slot_state	state;
+};
+
+struct pipeline {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+
+	struct pl_slot	*slots;
+	unsigned int	n_slots;
+	/* Size of the buffer of every slot in bytes. */
+	size_t		slot_size;
+
+	/* Sequence numbers of the next slots to be produced and consumed. */
+	uint64_t	next_produce;
+	uint64_t	next_consume;
+	/* Number of slots to be produced since pl_start(). */
+	uint64_t	n_items;
+	bool		stopped;
+};
+
+#define PL_ITEMS_UNKNOWN	(UINT64_MAX)
+
+/* Number of worker threads that leaves a processor to the main thread,
+ * but is at least one and at most @max_workers.
+ */
+unsigned int pl_get_n_workers(unsigned int max_workers);
+
+/* Allocate @n_slots buffers aligned to 2^@align_order bytes.
+ * If memory is scarce, the buffers are smaller than @slot_size, but
+ * never smaller than 2^@align_order bytes; check pl_get_slot_size().
+ * Return zero on success or an errno value.
+ */
+int pl_init(struct pipeline *pl, unsigned int n_slots, size_t slot_size,
+	unsigned int align_order);
+void pl_free(struct pipeline *pl);
+
+static inline size_t pl_get_slot_size(const struct pipeline *pl)
+{
+	return pl->slot_size;
+}
+
+/* Bytes that all the slots of @pl can hold; this is the most data
+ * in flight through @pl.
+ */
+static inline uint64_t pl_get_size(const struct pipeline *pl)
+{
+	return (uint64_t)pl->n_slots * pl->slot_size;
+}
+
+static inline unsigned int pl_slot_index(const struct pipeline *pl,
+	const struct pl_slot *slot)
+{
+	return slot - pl->slots;
+}
+
+/* Sequence number of the next slot that pl_get_free() or pl_get_full()
+ * will return. Only meaningful to the thread that is the sole producer or
+ * the sole consumer, respectively, of @pl.
+ *
+ * A thread that holds slots while taking more slots must not take
+ * the slot whose sequence number is n_slots past the sequence number
+ * of a slot it still holds; otherwise it waits for itself.
+ */
+static inline uint64_t pl_next_produce_seq(const struct pipeline *pl)
+{
+	return pl->next_produce;
+}
+
+static inline uint64_t pl_next_consume_seq(const struct pipeline *pl)
+{
+	return pl->next_consume;
+}
+
+/* Prepare @pl to move @n_items slots; @n_items can be PL_ITEMS_UNKNOWN.
+ * No thread may be using @pl when this function is called.
+ */
+void pl_start(struct pipeline *pl, uint64_t n_items);
+
+/* These functions block, and return NULL once no slot will ever be
+ * available, that is, all items were moved, or pl_close() or
+ * pl_stop() was called.
+ */
+struct pl_slot *pl_get_free(struct pipeline *pl);
+struct pl_slot *pl_get_full(struct pipeline *pl);
+
+void pl_put_full(struct pipeline *pl, struct pl_slot *slot);
+void pl_put_free(struct pipeline *pl, struct pl_slot *slot);
+
+/* Wait until consumers drained all the slots produced so far.
+ * Only a producer that holds no slot may call this function.
+ */
+void pl_wait_drained(struct pipeline *pl);
+
+/* No more slots will be produced; the slots already produced or
+ * being produced are still consumed.
+ */
+void pl_close(struct pipeline *pl);
+
+/* Abandon all slots not yet handed out to producers or consumers. */
+void pl_stop(struct pipeline *pl);
+
+#endif	/* HEADER_LIBPIPE_H */
@@ -43,6 +43,9 @@ struct rdwr_info {
 	uint64_t cache_pos;
 	uint64_t cache_size_block;
 	uint64_t salt;
+	/* Pattern kernels for the block order of the device. */
+	fill_block_fn fill_block;
+	validate_block_fn validate_block;
 
 	struct dynamic_buffer seqw_dbuf;
 	struct flow seqw_fw;
@@ -72,7 +75,7 @@ static int write_random_blocks(struct device *dev, const uint64_t pos[],
 
 	start_measurement(&rwi->randw_fw);
 	for (i = 0; i < n_pos; i++) {
-		fill_buffer_with_block(buffer, block_order,
+		rwi->fill_block(buffer, block_order,
 			pos[i] << block_order, rwi->salt);
 		if (_write_blocks(dev, buffer, pos[i], pos[i], &rwi->randw_fw,
 				cb, indent))
@@ -115,7 +118,7 @@ static int write_blocks(struct device *dev,
 
 		stamp_blk = buffer;
 		for (pos = first_pos; pos < next_pos; pos++) {
-			fill_buffer_with_block(stamp_blk, block_order, offset,
+			rwi->fill_block(stamp_blk, block_order, offset,
 				rwi->salt);
 			stamp_blk += block_size;
 			offset += block_size;
@@ -223,7 +226,7 @@ static int find_first_x_block(struct device *dev,
 		if (read_block(dev, probe_blk, x_blocks[i].pos, &rwi->randr_fw,
 				cb, indent))
 			return true;
-		bs = validate_buffer_with_block(probe_blk, block_order,
+		bs = rwi->validate_block(probe_blk, block_order,
 			x_blocks[i].expected_offset, &found_offset, rwi->salt);
 		measure(&rwi->randr_fw, 1, NULL);
 
@@ -251,6 +254,7 @@ static int find_first_bad_block(struct device *dev, const uint64_t pos[],
 	enum block_state bs;
 	uint32_t i;
 
+	assert(n_pos > 0);
 	for (i = 0; i < n_pos; i++) {
 		x_blocks[i].pos = pos[i];
 		x_blocks[i].expected_offset = pos[i] << block_order;
@@ -815,6 +819,8 @@ int probe_device(struct device *dev, struct probe_results *results,
 	int wrap;
 
 	dbuf_init(&rwi.seqw_dbuf);
+	rwi.fill_block = get_fill_block_fn(block_order);
+	rwi.validate_block = get_validate_block_fn(block_order);
 	/* We initialize total_blocks to 0 because inc_total_blocks() is called
 	 * to update it when new blocks become available.
 	 */
@@ -7,6 +7,12 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <unistd.h>	/* For sysconf().	*/
+
+#if defined(__x86_64__) && defined(__SSE2__)
+#include <emmintrin.h>	/* For _mm_stream_si64() and _mm_sfence().	*/
+#define HAVE_STREAMING_STORES
+#endif
 
 #include "libutils.h"
 #include "version.h"
@@ -216,31 +222,182 @@ long long arg_to_ll_bytes(const struct argp_state *state,
 	return ll;
 }
 
-static inline uint64_t next_random_number(uint64_t random_number)
+#define LCG_MUL		(4294967311ULL)
+#define LCG_INC		(17ULL)
+
+/* The next random number of x is LCG_MUL * x + LCG_INC.
+ *
+ * The pattern is a single LCG chain, so computing it one number at a time
+ * makes every multiplication wait for the previous one.
+ * To break this dependency, the pattern is generated in PATTERN_LANES
+ * lanes: lane j holds the j-th next random number, and every lane jumps
+ * PATTERN_LANES numbers ahead at once. The lanes are independent of
+ * each other, so the processor can pipeline their multiplications, and
+ * compilers can vectorize the loops over the lanes. The output is
+ * the very same stream of the single chain.
+ *
+ * Jumping n numbers ahead is x -> LCG_MUL_n * x + LCG_INC_n, and
+ * jumping m numbers ahead after jumping n numbers ahead gives
+ *	LCG_MUL_(m+n) = LCG_MUL_m * LCG_MUL_n, and
+ *	LCG_INC_(m+n) = LCG_MUL_m * LCG_INC_n + LCG_INC_m.
+ * Unsigned arithmetic wraps around, so the constants below are
+ * computed modulo 2^64 at compile time.
+ */
+#define PATTERN_LANES	(8)
+#define LCG_MUL_1	LCG_MUL
+#define LCG_INC_1	LCG_INC
+#define LCG_MUL_2	(LCG_MUL_1 * LCG_MUL_1)
+#define LCG_INC_2	(LCG_MUL_1 * LCG_INC_1 + LCG_INC_1)
+#define LCG_MUL_3	(LCG_MUL_1 * LCG_MUL_2)
+#define LCG_INC_3	(LCG_MUL_1 * LCG_INC_2 + LCG_INC_1)
+#define LCG_MUL_4	(LCG_MUL_2 * LCG_MUL_2)
+#define LCG_INC_4	(LCG_MUL_2 * LCG_INC_2 + LCG_INC_2)
+#define LCG_MUL_5	(LCG_MUL_1 * LCG_MUL_4)
+#define LCG_INC_5	(LCG_MUL_1 * LCG_INC_4 + LCG_INC_1)
+#define LCG_MUL_6	(LCG_MUL_2 * LCG_MUL_4)
+#define LCG_INC_6	(LCG_MUL_2 * LCG_INC_4 + LCG_INC_2)
+#define LCG_MUL_7	(LCG_MUL_3 * LCG_MUL_4)
+#define LCG_INC_7	(LCG_MUL_3 * LCG_INC_4 + LCG_INC_3)
+#define LCG_MUL_8	(LCG_MUL_4 * LCG_MUL_4)
+#define LCG_INC_8	(LCG_MUL_4 * LCG_INC_4 + LCG_INC_4)
+
+/* Lane j starts j + 1 numbers after the seed. Seeding every lane straight
+ * from the seed, instead of from the previous lane, avoids a chain of
+ * PATTERN_LANES dependent multiplications at the start of every block,
+ * which matters for blocks as small as a sector.
+ */
+static const uint64_t lane_mul[PATTERN_LANES] = {
+	LCG_MUL_1, LCG_MUL_2, LCG_MUL_3, LCG_MUL_4,
+	LCG_MUL_5, LCG_MUL_6, LCG_MUL_7, LCG_MUL_8,
+};
+
+static const uint64_t lane_inc[PATTERN_LANES] = {
+	LCG_INC_1, LCG_INC_2, LCG_INC_3, LCG_INC_4,
+	LCG_INC_5, LCG_INC_6, LCG_INC_7, LCG_INC_8,
+};
+
+static inline void init_lanes(uint64_t *lanes, uint64_t seed)
 {
-	return random_number * 4294967311ULL + 17;
+	unsigned int j;
+
+#pragma GCC unroll 8
+	for (j = 0; j < PATTERN_LANES; j++)
+		lanes[j] = seed * lane_mul[j] + lane_inc[j];
 }
 
-void fill_buffer_with_block(void *buf, unsigned int block_order,
-	uint64_t offset, uint64_t salt)
+static inline uint64_t next_lane_number(uint64_t lane_number)
+{
+	return lane_number * LCG_MUL_8 + LCG_INC_8;
+}
+
+/* Non-temporal stores write to memory bypassing the processor caches.
+ * Only use them with store_fence() after the last store.
+ */
+static inline void store_word(uint64_t *p, uint64_t word, bool streaming)
+{
+#ifdef HAVE_STREAMING_STORES
+	if (streaming) {
+		_mm_stream_si64((long long *)p, word);
+		return;
+	}
+#else
+	UNUSED(streaming);
+#endif
+	*p = word;
+}
+
+static inline void store_fence(bool streaming)
+{
+#ifdef HAVE_STREAMING_STORES
+	if (streaming)
+		_mm_sfence();
+#else
+	UNUSED(streaming);
+#endif
+}
+
+/* Write the @n random numbers that follow @seed into @int64_array. */
+static inline void fill_random_numbers(uint64_t *int64_array, uint64_t n,
+	uint64_t seed, bool streaming)
+{
+	uint64_t lanes[PATTERN_LANES];
+	uint64_t i;
+	unsigned int j;
+
+	init_lanes(lanes, seed);
+	for (i = 0; i + PATTERN_LANES <= n; i += PATTERN_LANES) {
+		/* Unrolling keeps the lanes in registers. */
+#pragma GCC unroll 8
+		for (j = 0; j < PATTERN_LANES; j++) {
+			store_word(&int64_array[i + j], lanes[j], streaming);
+			lanes[j] = next_lane_number(lanes[j]);
+		}
+	}
+	for (j = 0; i < n; i++, j++)
+		store_word(&int64_array[i], lanes[j], streaming);
+}
+
+uint64_t lcg_jump(uint64_t random_number, uint64_t steps)
+{
+	/* Jumping 2^i numbers ahead is x -> mul * x + inc, and
+	 * composing two such jumps is another one of the same form.
+	 * So, walk the bits of @steps squaring the jump of the current bit,
+	 * and apply the jumps of the bits that are set.
+	 */
+	uint64_t mul = LCG_MUL, inc = LCG_INC;
+
+	while (steps > 0) {
+		if (steps & 1)
+			random_number = random_number * mul + inc;
+		inc = inc * (mul + 1);
+		mul = mul * mul;
+		steps >>= 1;
+	}
+	return random_number;
+}
+
+static inline void fill_block(void *buf, unsigned int block_order,
+	uint64_t offset, uint64_t salt, bool streaming)
 {
 	const unsigned int num_int64 = 1U << (block_order - 3);
 	uint64_t *int64_array = buf;
-	uint64_t random_number = offset ^ salt;
-	unsigned int i;
 
 	assert(block_order >= SECTOR_ORDER);
 
 	/* DO NOT add salt here!
 	 * Drives know the offset, so applying salt to it leaks the salt.
 	 */
-	int64_array[0] = offset;
+	store_word(&int64_array[0], offset, streaming);
 
 	/* Thanks to salt, a drive has to guess the seed. */
-	for (i = 1; i < num_int64; i++) {
-		int64_array[i] = random_number =
-			next_random_number(random_number);
+	fill_random_numbers(int64_array + 1, num_int64 - 1, offset ^ salt,
+		streaming);
+}
+
+void fill_buffer_with_block(void *buf, unsigned int block_order,
+	uint64_t offset, uint64_t salt)
+{
+	fill_block(buf, block_order, offset, salt, false);
+}
+
+void fill_buffer_with_block_slice(void *buf, uint64_t offset, uint64_t salt,
+	uint64_t first_word, uint64_t n_words)
+{
+	uint64_t *int64_array = buf;
+
+	if (n_words == 0)
+		return;
+
+	if (first_word == 0) {
+		int64_array[0] = offset;
+		int64_array++;
+		first_word++;
+		n_words--;
 	}
+
+	/* Word i is the i-th random number after the seed. */
+	fill_random_numbers(int64_array, n_words,
+		lcg_jump(offset ^ salt, first_word - 1), false);
 }
 
 const char *block_state_to_str(enum block_state state)
@@ -255,28 +412,63 @@ const char *block_state_to_str(enum block_state state)
 	return conv_array[state];
 }
 
-enum block_state validate_buffer_with_block(const void *buf,
+/* Count the bit errors between @n words found and @n words expected.
+ * Only words that differ are counted because, unless the processor has
+ * a popcount instruction, __builtin_popcountll() is a function call.
+ */
+static inline unsigned int count_bit_errors(const uint64_t *found,
+	const uint64_t *expected, unsigned int n)
+{
+	unsigned int i, count = 0;
+
+	for (i = 0; i < n; i++) {
+		const uint64_t diff = found[i] ^ expected[i];
+		if (diff != 0)
+			count += __builtin_popcountll(diff);
+	}
+	return count;
+}
+
+static inline enum block_state validate_block(const void *buf,
 	unsigned int block_order, uint64_t expected_offset,
 	uint64_t *pfound_offset, uint64_t salt)
 {
 	const uint64_t *int64_array = buf;
 	const uint64_t found_offset = int64_array[0];
 	const unsigned int num_int64 = 1U << (block_order - 3);
-	uint64_t random_number = found_offset ^ salt;
 	const unsigned int bit_error_tolerance = 7;
 	unsigned int bit_error_count = 0;
-	unsigned int i;
+	uint64_t lanes[PATTERN_LANES];
+	unsigned int i, j;
 
 	assert(block_order >= SECTOR_ORDER);
 
-	for (i = 1; i < num_int64; i++) {
-		random_number = next_random_number(random_number);
-		if (int64_array[i] != random_number) {
-			bit_error_count += __builtin_popcountll(
-				int64_array[i] ^ random_number);
+	/* Compare PATTERN_LANES words at a time, and only count bit errors
+	 * when some of these words differ. On healthy media, the comparison
+	 * is all that is done.
+	 */
+	init_lanes(lanes, found_offset ^ salt);
+	for (i = 1; i + PATTERN_LANES <= num_int64; i += PATTERN_LANES) {
+		uint64_t diff = 0;
+
+#pragma GCC unroll 8
+		for (j = 0; j < PATTERN_LANES; j++)
+			diff |= int64_array[i + j] ^ lanes[j];
+
+		if (diff != 0) {
+			bit_error_count += count_bit_errors(&int64_array[i],
+				lanes, PATTERN_LANES);
 			if (bit_error_count > bit_error_tolerance)
 				break;
 		}
+
+#pragma GCC unroll 8
+		for (j = 0; j < PATTERN_LANES; j++)
+			lanes[j] = next_lane_number(lanes[j]);
+	}
+	if (i < num_int64 && bit_error_count <= bit_error_tolerance) {
+		bit_error_count += count_bit_errors(&int64_array[i], lanes,
+			num_int64 - i);
 	}
 
 	*pfound_offset = found_offset;
@@ -295,13 +487,17 @@ enum block_state validate_buffer_with_block(const void *buf,
 	return bs_bad;
 }
 
-enum block_state validate_block_update_stats(const void *buf,
+enum block_state validate_buffer_with_block(const void *buf,
 	unsigned int block_order, uint64_t expected_offset,
-	uint64_t *pfound_offset, uint64_t salt, struct block_stats *stats)
+	uint64_t *pfound_offset, uint64_t salt)
 {
-	enum block_state state = validate_buffer_with_block(buf, block_order,
-		expected_offset, pfound_offset, salt);
+	return validate_block(buf, block_order, expected_offset,
+		pfound_offset, salt);
+}
 
+static inline void update_stats(struct block_stats *stats,
+	enum block_state state)
+{
 	switch (state) {
 	case bs_good:
 		stats->ok++;
@@ -318,10 +514,239 @@ enum block_state validate_block_update_stats(const void *buf,
 	default:
 		assert(0);
 	}
+}
 
+enum block_state validate_block_update_stats(const void *buf,
+	unsigned int block_order, uint64_t expected_offset,
+	uint64_t *pfound_offset, uint64_t salt, struct block_stats *stats)
+{
+	enum block_state state = validate_block(buf, block_order,
+		expected_offset, pfound_offset, salt);
+	update_stats(stats, state);
 	return state;
 }
 
+static inline void fill_blocks(void *buf, uint64_t n_blocks,
+	unsigned int block_order, uint64_t offset, uint64_t salt,
+	bool streaming)
+{
+	char *block = buf;
+	const uint64_t block_size = 1ULL << block_order;
+	uint64_t i;
+
+	/* Test @streaming out of the loops, so each loop is compiled
+	 * with a constant and keeps its stores in the inner loop simple.
+	 */
+	if (streaming) {
+		for (i = 0; i < n_blocks; i++) {
+			fill_block(block, block_order, offset, salt, true);
+			block += block_size;
+			offset += block_size;
+		}
+		store_fence(true);
+		return;
+	}
+
+	for (i = 0; i < n_blocks; i++) {
+		fill_block(block, block_order, offset, salt, false);
+		block += block_size;
+		offset += block_size;
+	}
+}
+
+/* How far ahead of validation streaming reads are prefetched. */
+#define STREAMING_PREFETCH_SIZE	(4 * KILOBYTE_SIZE)
+#define CACHE_LINE_SIZE		(64)
+
+/* Prefetch with no temporal locality, so the data read from a large
+ * buffer does not push out of the processor caches what is going to
+ * be reused.
+ */
+static inline void prefetch_block(const char *block,
+	unsigned int block_order)
+{
+	const uint64_t block_size = 1ULL << block_order;
+	uint64_t i;
+
+	for (i = 0; i < block_size; i += CACHE_LINE_SIZE)
+		__builtin_prefetch(block + i, 0, 0);
+}
+
+static inline uint64_t validate_blocks(const void *buf, uint64_t n_blocks,
+	unsigned int block_order, uint64_t expected_offset, uint64_t salt,
+	struct block_stats *stats, bool streaming)
+{
+	const char *block = buf;
+	const uint64_t block_size = 1ULL << block_order;
+	const uint64_t prefetch_blocks =
+		STREAMING_PREFETCH_SIZE >> block_order;
+	struct block_stats local = {0, 0, 0, 0};
+	uint64_t first_failure = n_blocks;
+	uint64_t i;
+
+	for (i = 0; i < n_blocks; i++) {
+		uint64_t found_offset;
+		enum block_state state;
+
+		if (streaming && i + prefetch_blocks < n_blocks) {
+			prefetch_block(block + (prefetch_blocks << block_order),
+				block_order);
+		}
+
+		state = validate_block(block, block_order, expected_offset,
+			&found_offset, salt);
+		if (state != bs_good && first_failure == n_blocks)
+			first_failure = i;
+		update_stats(&local, state);
+		block += block_size;
+		expected_offset += block_size;
+	}
+
+	stats->ok += local.ok;
+	stats->bad += local.bad;
+	stats->changed += local.changed;
+	stats->overwritten += local.overwritten;
+	return first_failure;
+}
+
+/* Kernels specialized for the block orders F3 uses the most: sectors,
+ * and the usual block sizes of file systems and flash memories.
+ * With the block order known at compile time, the number of words of
+ * a block is a constant, so compilers can fully unroll and schedule
+ * the loops.
+ */
+#define GEN_PATTERN_KERNELS(order)					\
+	static void fill_block_##order(void *buf,			\
+		unsigned int block_order, uint64_t offset,		\
+		uint64_t salt)						\
+	{								\
+		assert(block_order == (order));				\
+		fill_block(buf, (order), offset, salt, false);		\
+	}								\
+									\
+	static enum block_state validate_block_##order(			\
+		const void *buf, unsigned int block_order,		\
+		uint64_t expected_offset, uint64_t *pfound_offset,	\
+		uint64_t salt)						\
+	{								\
+		assert(block_order == (order));				\
+		return validate_block(buf, (order), expected_offset,	\
+			pfound_offset, salt);				\
+	}								\
+									\
+	static void fill_blocks_##order(void *buf, uint64_t n_blocks,	\
+		uint64_t offset, uint64_t salt, bool streaming)		\
+	{								\
+		fill_blocks(buf, n_blocks, (order), offset, salt,	\
+			streaming);					\
+	}								\
+									\
+	static uint64_t validate_blocks_##order(const void *buf,	\
+		uint64_t n_blocks, uint64_t expected_offset,		\
+		uint64_t salt, struct block_stats *stats,		\
+		bool streaming)						\
+	{								\
+		return validate_blocks(buf, n_blocks, (order),		\
+			expected_offset, salt, stats, streaming);	\
+	}
+
+GEN_PATTERN_KERNELS(9)
+GEN_PATTERN_KERNELS(12)
+GEN_PATTERN_KERNELS(13)
+GEN_PATTERN_KERNELS(16)
+
+fill_block_fn get_fill_block_fn(unsigned int block_order)
+{
+	switch (block_order) {
+	case 9:
+		return fill_block_9;
+	case 12:
+		return fill_block_12;
+	case 13:
+		return fill_block_13;
+	case 16:
+		return fill_block_16;
+	default:
+		return fill_buffer_with_block;
+	}
+}
+
+validate_block_fn get_validate_block_fn(unsigned int block_order)
+{
+	switch (block_order) {
+	case 9:
+		return validate_block_9;
+	case 12:
+		return validate_block_12;
+	case 13:
+		return validate_block_13;
+	case 16:
+		return validate_block_16;
+	default:
+		return validate_buffer_with_block;
+	}
+}
+
+#define DEFAULT_CACHE_SIZE	(8 * MEGABYTE_SIZE)
+
+bool is_larger_than_cache(uint64_t size)
+{
+	long cache_size = -1;
+
+#ifdef _SC_LEVEL3_CACHE_SIZE
+	cache_size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+	if (cache_size <= 0)
+		cache_size = DEFAULT_CACHE_SIZE;
+	return size > (uint64_t)cache_size;
+}
+
+void fill_buffer_with_blocks(void *buf, uint64_t n_blocks,
+	unsigned int block_order, uint64_t offset, uint64_t salt,
+	bool streaming)
+{
+	switch (block_order) {
+	case 9:
+		fill_blocks_9(buf, n_blocks, offset, salt, streaming);
+		break;
+	case 12:
+		fill_blocks_12(buf, n_blocks, offset, salt, streaming);
+		break;
+	case 13:
+		fill_blocks_13(buf, n_blocks, offset, salt, streaming);
+		break;
+	case 16:
+		fill_blocks_16(buf, n_blocks, offset, salt, streaming);
+		break;
+	default:
+		fill_blocks(buf, n_blocks, block_order, offset, salt,
+			streaming);
+	}
+}
+
+uint64_t validate_blocks_update_stats(const void *buf, uint64_t n_blocks,
+	unsigned int block_order, uint64_t expected_offset, uint64_t salt,
+	struct block_stats *stats, bool streaming)
+{
+	switch (block_order) {
+	case 9:
+		return validate_blocks_9(buf, n_blocks, expected_offset,
+			salt, stats, streaming);
+	case 12:
+		return validate_blocks_12(buf, n_blocks, expected_offset,
+			salt, stats, streaming);
+	case 13:
+		return validate_blocks_13(buf, n_blocks, expected_offset,
+			salt, stats, streaming);
+	case 16:
+		return validate_blocks_16(buf, n_blocks, expected_offset,
+			salt, stats, streaming);
+	default:
+		return validate_blocks(buf, n_blocks, block_order,
+			expected_offset, salt, stats, streaming);
+	}
+}
+
 static void print_stat(const char *prefix, uint64_t count,
 	unsigned int block_order, const char *unit_name)
 {
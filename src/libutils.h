@@ -103,6 +103,41 @@ long long arg_to_ll_bytes(const struct argp_state *state, const char *arg);
 void fill_buffer_with_block(void *buf, unsigned int block_order,
 	uint64_t offset, uint64_t salt);
 
+/* Return true if a buffer of @size bytes does not fit in the cache of
+ * the processor. Filling or validating such a buffer with @streaming set
+ * avoids evicting everything else from the cache for nothing, since
+ * the first bytes of the buffer are gone from the cache before
+ * the buffer is used again anyway.
+ */
+bool is_larger_than_cache(uint64_t size);
+
+/* Fill @buf with the @n_blocks consecutive blocks whose first block is
+ * at @offset. If @streaming is true, use non-temporal stores, which bypass
+ * the processor caches, where available.
+ *
+ * Dependent on the byte order of the processor (i.e. endianness).
+ */
+void fill_buffer_with_blocks(void *buf, uint64_t n_blocks,
+	unsigned int block_order, uint64_t offset, uint64_t salt,
+	bool streaming);
+
+/* Return the random number that is @steps numbers after @random_number
+ * in the sequence of random numbers of the blocks.
+ * It takes O(log @steps) multiplications, so any word of a block can be
+ * computed without computing the words before it.
+ */
+uint64_t lcg_jump(uint64_t random_number, uint64_t steps);
+
+/* Fill @buf with the @n_words 64-bit words of the block at @offset that
+ * start at word @first_word. The result is the same slice of the block
+ * written by fill_buffer_with_block(), so disjoint slices of a block can be
+ * generated independently (e.g. by different threads).
+ *
+ * Dependent on the byte order of the processor (i.e. endianness).
+ */
+void fill_buffer_with_block_slice(void *buf, uint64_t offset, uint64_t salt,
+	uint64_t first_word, uint64_t n_words);
+
 enum block_state {
 	bs_unknown,
 	bs_good,
@@ -113,6 +148,22 @@ enum block_state {
 
 const char *block_state_to_str(enum block_state state);
 
+typedef void (*fill_block_fn)(void *buf, unsigned int block_order,
+	uint64_t offset, uint64_t salt);
+typedef enum block_state (*validate_block_fn)(const void *buf,
+	unsigned int block_order, uint64_t expected_offset,
+	uint64_t *pfound_offset, uint64_t salt);
+
+/* Return versions of fill_buffer_with_block() and
+ * validate_buffer_with_block() that only work with blocks of order
+ * @block_order. Callers select them once, and save the overhead of
+ * generic loops in every block they process; this matters most for
+ * small blocks. For block orders that have no specialized version,
+ * the generic functions are returned.
+ */
+fill_block_fn get_fill_block_fn(unsigned int block_order);
+validate_block_fn get_validate_block_fn(unsigned int block_order);
+
 struct block_stats {
 	uint64_t ok;
 	uint64_t bad;
@@ -129,6 +180,17 @@ enum block_state validate_block_update_stats(const void *buf,
 	unsigned int block_order, uint64_t expected_offset,
 	uint64_t *pfound_offset, uint64_t salt, struct block_stats *stats);
 
+/* Validate the @n_blocks consecutive blocks in @buf, whose first block is
+ * expected at @expected_offset, and add their states to @stats.
+ * If @streaming is true, prefetch @buf without polluting
+ * the processor caches.
+ * Return the index of the first block that is not good, or
+ * @n_blocks if all blocks are good.
+ */
+uint64_t validate_blocks_update_stats(const void *buf, uint64_t n_blocks,
+	unsigned int block_order, uint64_t expected_offset, uint64_t salt,
+	struct block_stats *stats, bool streaming);
+
 static inline uint64_t diff_timespec_ns(const struct timespec *t1,
 	const struct timespec *t2)
 {